@@ -0,0 +1,560 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "config.h"
+
+#include <stdlib.h> /* strtoul, strtod, realloc */
+#include <stdio.h> /* fopen, fgets */
+#include <string.h> /* strcmp, strchr, strtok, strdup */
+#include <ctype.h> /* isspace */
+#include <limits.h> /* UINT_MAX, ULONG_MAX, USHRT_MAX */
+#include <errno.h> /* errno */
+
+/* Max length of a line in a configuration file */
+#define MAX_LINE_LEN 256
+
+/* Parse an unsigned integer, which must not exceed max
+ * @return: non-zero value if the value is invalid
+ */
+static int parse_uint(const char *val, unsigned int max, unsigned int *out)
+{
+	char *c;
+	unsigned long parsed;
+	errno = 0;
+	parsed = strtoul(val, &c, 0);
+	if (errno || c == val || *c != '\0' || *val == '-' || parsed > max)
+		return -1;
+	*out = parsed;
+	return 0;
+}
+
+/* Parse a probability, between 0 and 1
+ * @return: non-zero value if the value is invalid
+ */
+static int parse_prob(const char *val, double *out)
+{
+	char *c;
+	double parsed;
+	errno = 0;
+	parsed = strtod(val, &c);
+	if (errno || c == val || *c != '\0' || !(parsed >= 0 && parsed <= 1))
+		return -1;
+	*out = parsed;
+	return 0;
+}
+
+/* Parse a flag, 0 or 1
+ * @return: non-zero value if the value is invalid
+ */
+static int parse_flag(const char *val, int *out)
+{
+	unsigned int parsed;
+	if (parse_uint(val, 1, &parsed))
+		return -1;
+	*out = parsed;
+	return 0;
+}
+
+static int parse_corruption(const char *val, int *out)
+{
+	int x;
+	for (x = LINKSIM_CORRUPT_BYTE; x <= LINKSIM_CORRUPT_BER; ++x) {
+		if (!strcmp(val, linksim_corruption_str(x))) {
+			*out = x;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int parse_dist(const char *val, int *out)
+{
+	int x;
+	for (x = LINKSIM_DIST_UNIFORM; x <= LINKSIM_DIST_EMPIRICAL; ++x) {
+		if (!strcmp(val, linksim_dist_str(x))) {
+			*out = x;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int parse_direction(const char *val, int *out)
+{
+	if (!strcmp(val, "forward"))
+		*out = LINK_FORWARD;
+	else if (!strcmp(val, "reverse"))
+		*out = LINK_REVERSE;
+	else if (!strcmp(val, "both"))
+		*out = LINK_BOTH_WAYS;
+	else
+		return -1;
+	return 0;
+}
+
+int config_set(struct linksim_params *p, const char *key, const char *value)
+{
+	if (!strcmp(key, "delay"))
+		return parse_uint(value, UINT_MAX, &p->delay);
+	if (!strcmp(key, "jitter"))
+		return parse_uint(value, UINT_MAX, &p->jitter);
+	if (!strcmp(key, "delay_dist"))
+		return parse_dist(value, &p->delay_dist);
+	if (!strcmp(key, "delay_corr"))
+		return parse_uint(value, 100, &p->delay_corr);
+	if (!strcmp(key, "err_rate"))
+		return parse_uint(value, 100, &p->err_rate);
+	if (!strcmp(key, "corruption"))
+		return parse_corruption(value, &p->corruption);
+	if (!strcmp(key, "ber"))
+		return parse_prob(value, &p->ber);
+	if (!strcmp(key, "burst_len"))
+		return parse_uint(value, UINT_MAX, &p->burst_len);
+	if (!strcmp(key, "cut_rate"))
+		return parse_uint(value, 100, &p->cut_rate);
+	if (!strcmp(key, "loss_rate"))
+		return parse_uint(value, 100, &p->loss_rate);
+	if (!strcmp(key, "rate"))
+		return parse_uint(value, UINT_MAX, &p->rate);
+	if (!strcmp(key, "in_order"))
+		return parse_flag(value, &p->in_order);
+	if (!strcmp(key, "link_direction"))
+		return parse_direction(value, &p->link_direction);
+	return -1;
+}
+
+int config_set_list(struct linksim_params *params, const char *list)
+{
+	char buf[MAX_LINE_LEN], *tok, *value;
+	struct linksim_params p = *params;
+	if (strlen(list) >= sizeof(buf))
+		return -1;
+	strcpy(buf, list);
+	for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+		if (!(value = strchr(tok, '=')))
+			return -1;
+		*value++ = '\0';
+		if (config_set(&p, tok, value))
+			return -1;
+	}
+	/* All or nothing */
+	*params = p;
+	return 0;
+}
+
+/* Strip the leading and trailing white spaces of s, in-place */
+static char *strip(char *s)
+{
+	char *end;
+	while (isspace((unsigned char)*s))
+		++s;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		--end;
+	*end = '\0';
+	return s;
+}
+
+int config_load(const char *path, struct linksim_params *params)
+{
+	char line[MAX_LINE_LEN], *key, *value, *c;
+	struct linksim_params p = *params;
+	unsigned int lineno = 0;
+	int err = 0;
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		++lineno;
+		/* Ignore comments and empty lines */
+		if ((c = strchr(line, '#')))
+			*c = '\0';
+		key = strip(line);
+		if (!*key)
+			continue;
+		/* Accept both 'key = value' and 'key value' */
+		if ((c = strchr(key, '='))) {
+			*c = '\0';
+			value = c + 1;
+		} else {
+			for (value = key; *value && !isspace((unsigned char)*value);
+					++value);
+			if (*value)
+				*value++ = '\0';
+		}
+		key = strip(key);
+		value = strip(value);
+		if (config_set(&p, key, value)) {
+			fprintf(stderr, "!! %s:%u: invalid parameter '%s' = '%s'\n",
+					path, lineno, key, value);
+			err = -1;
+		}
+	}
+	if (ferror(f)) {
+		perror(path);
+		err = -1;
+	}
+	fclose(f);
+	/* All or nothing */
+	if (!err)
+		*params = p;
+	return err;
+}
+
+/* Parse the date of a schedule step: ms, or s with an 's' suffix
+ * @return: non-zero value if the date is invalid
+ */
+static int parse_date(const char *val, unsigned long *out)
+{
+	char *c;
+	double parsed;
+	errno = 0;
+	parsed = strtod(val, &c);
+	if (errno || c == val || parsed < 0)
+		return -1;
+	if (!strcmp(c, "s"))
+		parsed *= 1000;
+	else if (*c != '\0' && strcmp(c, "ms"))
+		return -1;
+	if (parsed >= (double)ULONG_MAX)
+		return -1;
+	*out = (unsigned long)parsed;
+	return 0;
+}
+
+int config_load_schedule(const char *path,
+		const struct linksim_params *params,
+		struct linksim_step **steps, size_t *n)
+{
+	char line[MAX_LINE_LEN], *tok, *value, *c;
+	struct linksim_step *s = NULL, *tmp;
+	size_t count = 0, alloc = 0;
+	unsigned int lineno = 0;
+	int err = 0;
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	while (!err && fgets(line, sizeof(line), f)) {
+		++lineno;
+		/* Ignore comments and empty lines */
+		if ((c = strchr(line, '#')))
+			*c = '\0';
+		if (!(tok = strtok(line, " \t\r\n")))
+			continue;
+		if (count == alloc) {
+			alloc = alloc ? alloc << 1 : 16;
+			if (!(tmp = realloc(s, alloc * sizeof(*s)))) {
+				perror("Cannot allocate the schedule");
+				err = -1;
+				break;
+			}
+			s = tmp;
+		}
+		/* Each step starts from the parameters of the previous one */
+		s[count].params = count ? s[count - 1].params : *params;
+		s[count].ramp = 0;
+		if (parse_date(tok, &s[count].at) ||
+			(count && s[count].at < s[count - 1].at)) {
+			fprintf(stderr, "!! %s:%u: invalid date '%s', dates must be "
+					"increasing\n", path, lineno, tok);
+			err = -1;
+			break;
+		}
+		while ((tok = strtok(NULL, " \t\r\n"))) {
+			if (!strcmp(tok, "ramp")) {
+				s[count].ramp = 1;
+				continue;
+			}
+			if ((value = strchr(tok, '=')))
+				*value++ = '\0';
+			if (!value || config_set(&s[count].params, tok, value)) {
+				fprintf(stderr, "!! %s:%u: invalid parameter '%s'\n",
+						path, lineno, tok);
+				err = -1;
+				break;
+			}
+		}
+		++count;
+	}
+	if (ferror(f)) {
+		perror(path);
+		err = -1;
+	}
+	fclose(f);
+	if (err) {
+		free(s);
+		return -1;
+	}
+	*steps = s;
+	*n = count;
+	return 0;
+}
+
+int config_load_rules(const char *path, struct linksim_rule **rules,
+		size_t *n)
+{
+	char line[MAX_LINE_LEN], err_str[128], *expr, *tok, *value, *c;
+	struct linksim_rule *r = NULL, *tmp;
+	linksim_filter_t *filter;
+	size_t count = 0, alloc = 0;
+	unsigned int lineno = 0;
+	int err = 0;
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	while (!err && fgets(line, sizeof(line), f)) {
+		++lineno;
+		/* Ignore comments and empty lines */
+		if ((c = strchr(line, '#')))
+			*c = '\0';
+		expr = strip(line);
+		if (!*expr)
+			continue;
+		if (!(c = strchr(expr, ':'))) {
+			fprintf(stderr, "!! %s:%u: expected 'filter: parameters'\n",
+					path, lineno);
+			err = -1;
+			break;
+		}
+		*c = '\0';
+		if (!(filter = linksim_filter_compile(expr, err_str,
+						sizeof(err_str)))) {
+			fprintf(stderr, "!! %s:%u: invalid filter: %s\n", path, lineno,
+					err_str);
+			err = -1;
+			break;
+		}
+		if (count == alloc) {
+			alloc = alloc ? alloc << 1 : 8;
+			if (!(tmp = realloc(r, alloc * sizeof(*r)))) {
+				perror("Cannot allocate the rules");
+				linksim_filter_del(filter);
+				err = -1;
+				break;
+			}
+			r = tmp;
+		}
+		r[count].filter = filter;
+		/* The matching packets only suffer what the rule tells */
+		linksim_params_init(&r[count].params);
+		++count;
+		for (tok = strtok(c + 1, " \t\r\n"); tok;
+				tok = strtok(NULL, " \t\r\n")) {
+			if ((value = strchr(tok, '=')))
+				*value++ = '\0';
+			if (!value || config_set(&r[count - 1].params, tok, value)) {
+				fprintf(stderr, "!! %s:%u: invalid parameter '%s'\n",
+						path, lineno, tok);
+				err = -1;
+				break;
+			}
+		}
+	}
+	if (ferror(f)) {
+		perror(path);
+		err = -1;
+	}
+	fclose(f);
+	if (err) {
+		config_free_rules(r, count);
+		return -1;
+	}
+	*rules = r;
+	*n = count;
+	return 0;
+}
+
+void config_free_rules(struct linksim_rule *rules, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i)
+		linksim_filter_del((linksim_filter_t*)rules[i].filter);
+	free(rules);
+}
+
+int config_load_histogram(const char *path, double **values,
+		double **weights, size_t *n)
+{
+	char line[MAX_LINE_LEN], *tok, *c;
+	double *v = NULL, *w = NULL, *tmp;
+	size_t count = 0, alloc = 0;
+	unsigned int lineno = 0;
+	int err = 0, valid;
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	while (!err && fgets(line, sizeof(line), f)) {
+		++lineno;
+		/* Ignore comments and empty lines */
+		if ((c = strchr(line, '#')))
+			*c = '\0';
+		if (!(tok = strtok(line, " \t\r\n")))
+			continue;
+		if (count == alloc) {
+			alloc = alloc ? alloc << 1 : 64;
+			if (!(tmp = realloc(v, alloc * sizeof(*v)))) {
+				perror("Cannot allocate the histogram");
+				err = -1;
+				break;
+			}
+			v = tmp;
+			if (!(tmp = realloc(w, alloc * sizeof(*w)))) {
+				perror("Cannot allocate the histogram");
+				err = -1;
+				break;
+			}
+			w = tmp;
+		}
+		errno = 0;
+		v[count] = strtod(tok, &c);
+		valid = !errno && c != tok && *c == '\0';
+		w[count] = 1;
+		if (valid && (tok = strtok(NULL, " \t\r\n"))) {
+			w[count] = strtod(tok, &c);
+			valid = !errno && c != tok && *c == '\0' && w[count] >= 0;
+		}
+		if (!valid || strtok(NULL, " \t\r\n")) {
+			fprintf(stderr, "!! %s:%u: expected 'value [count]'\n", path,
+					lineno);
+			err = -1;
+			break;
+		}
+		++count;
+	}
+	if (ferror(f)) {
+		perror(path);
+		err = -1;
+	}
+	fclose(f);
+	if (!err && !count) {
+		fprintf(stderr, "!! %s: the histogram is empty\n", path);
+		err = -1;
+	}
+	if (err) {
+		free(v);
+		free(w);
+		return -1;
+	}
+	*values = v;
+	*weights = w;
+	*n = count;
+	return 0;
+}
+
+int config_load_links(const char *path,
+		const struct linksim_params *params,
+		struct config_link **links, size_t *n)
+{
+	char line[MAX_LINE_LEN], *tok, *value, *c;
+	struct config_link *l = NULL, *tmp;
+	size_t count = 0, alloc = 0, i;
+	unsigned int lineno = 0;
+	int err = 0;
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	while (!err && fgets(line, sizeof(line), f)) {
+		++lineno;
+		/* Ignore comments and empty lines */
+		if ((c = strchr(line, '#')))
+			*c = '\0';
+		if (!(tok = strtok(line, " \t\r\n")))
+			continue;
+		if (count == alloc) {
+			alloc = alloc ? alloc << 1 : 16;
+			if (!(tmp = realloc(l, alloc * sizeof(*l)))) {
+				perror("Cannot allocate the links");
+				err = -1;
+				break;
+			}
+			l = tmp;
+		}
+		l[count].params = *params;
+		l[count].forward_host = NULL;
+		l[count].lineno = lineno;
+		if (parse_uint(tok, USHRT_MAX, &l[count].port) || !l[count].port ||
+				!(tok = strtok(NULL, " \t\r\n")) ||
+				!(l[count].forward_host = strdup(tok)) ||
+				!(tok = strtok(NULL, " \t\r\n")) ||
+				parse_uint(tok, USHRT_MAX, &l[count].forward_port) ||
+				!l[count].forward_port) {
+			fprintf(stderr, "!! %s:%u: expected 'port forward_host "
+					"forward_port'\n", path, lineno);
+			free(l[count].forward_host);
+			err = -1;
+			break;
+		}
+		++count;
+		/* Each socket must be bound to its own port */
+		for (i = 0; i + 1 < count; ++i)
+			if (l[i].port == l[count - 1].port) {
+				fprintf(stderr, "!! %s:%u: port %u is already used by "
+						"line %u\n", path, lineno, l[i].port, l[i].lineno);
+				err = -1;
+			}
+		while (!err && (tok = strtok(NULL, " \t\r\n"))) {
+			if ((value = strchr(tok, '=')))
+				*value++ = '\0';
+			if (!value || config_set(&l[count - 1].params, tok, value)) {
+				fprintf(stderr, "!! %s:%u: invalid parameter '%s'\n",
+						path, lineno, tok);
+				err = -1;
+			}
+		}
+	}
+	if (ferror(f)) {
+		perror(path);
+		err = -1;
+	}
+	fclose(f);
+	if (!err && !count) {
+		fprintf(stderr, "!! %s: no link is defined\n", path);
+		err = -1;
+	}
+	if (err) {
+		config_free_links(l, count);
+		return -1;
+	}
+	*links = l;
+	*n = count;
+	return 0;
+}
+
+void config_free_links(struct config_link *links, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i)
+		free(links[i].forward_host);
+	free(links);
+}
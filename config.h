@@ -0,0 +1,140 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef __CONFIG_H_
+#define __CONFIG_H_
+
+#include "linksim.h" /* linksim_params */
+
+/* Parsing of the link parameters from text, e.g. a configuration file:
+ *
+ *   # Comments start with a hash
+ *   delay = 100
+ *   loss_rate = 5
+ *   link_direction = both
+ *   corruption = ber  # byte, bit, burst or ber
+ *   ber = 1e-6
+ *   delay_dist = pareto  # uniform, normal, pareto, paretonormal, empirical
+ *   delay_corr = 25
+ *   in_order = 1  # Jitter does not reorder the packets
+ *
+ * The keys are the names of the fields of struct linksim_params.
+ *
+ * A schedule file lists the dates (in ms, or in s with an 's' suffix) at
+ * which some parameters change, each step inheriting the parameters of the
+ * previous one. With 'ramp', the parameters move linearly from the previous
+ * step instead of changing abruptly:
+ *
+ *   0      delay=10 loss_rate=0
+ *   30s    delay=200 ramp  # Congestion builds up
+ *   40s    loss_rate=100   # Outage
+ *   45s    loss_rate=0 delay=10
+ *
+ * A rules file gives their own parameters to the packets matching a filter
+ * (see linksim_filter_compile()). A packet gets the parameters of the first
+ * rule it matches, any parameter not given by the rule being that of a
+ * perfect link:
+ *
+ *   byte[0] >> 6 == 2 : loss_rate=50           # Drop half of the acks
+ *   dir == reverse && byte[0] >> 6 == 0 : delay=200
+ */
+
+/* Set one parameter from its textual representation
+ * @return: non-zero value if the key is unknown or the value invalid
+ */
+int config_set(struct linksim_params*, const char *key, const char *value);
+/* Set the parameters of a comma-separated list of key=value, e.g.
+ * "delay=20,loss_rate=5"
+ * @return: non-zero value if a key is unknown or a value invalid (params
+ *          is then untouched)
+ */
+int config_set_list(struct linksim_params*, const char *list);
+/* Update the parameters with the content of a configuration file.
+ * Errors are reported on stderr.
+ * @return: non-zero value on error (params is then untouched)
+ */
+int config_load(const char *path, struct linksim_params *params);
+/* Compile a schedule file into an array of steps.
+ * Errors are reported on stderr.
+ * @params: The parameters before the first step
+ * @steps: Set to the array of steps, to be freed
+ * @n: Set to the number of steps
+ * @return: non-zero value on error
+ */
+int config_load_schedule(const char *path,
+		const struct linksim_params *params,
+		struct linksim_step **steps, size_t *n);
+/* Compile a rules file.
+ * Errors are reported on stderr.
+ * @rules: Set to the array of rules, to be freed with config_free_rules()
+ * @n: Set to the number of rules
+ * @return: non-zero value on error
+ */
+int config_load_rules(const char *path, struct linksim_rule **rules,
+		size_t *n);
+/* Release rules and their filters */
+void config_free_rules(struct linksim_rule *rules, size_t n);
+/* Load a histogram of delays, one 'value count' line per bin, the count
+ * defaulting to 1 so that raw measurements can be given as well:
+ *
+ *   # delay (ms)  count
+ *   12.5          130
+ *   13            410
+ *
+ * Errors are reported on stderr.
+ * @values: Set to the array of values, to be freed
+ * @weights: Set to the array of counts, to be freed
+ * @n: Set to the number of bins
+ * @return: non-zero value on error
+ */
+int config_load_histogram(const char *path, double **values,
+		double **weights, size_t *n);
+/* A link of a links file */
+struct config_link {
+	unsigned int port; /* The UDP port on which it listens */
+	char *forward_host; /* The host to which it forwards the traffic */
+	unsigned int forward_port; /* The UDP port of that host */
+	struct linksim_params params; /* Its parameters */
+	unsigned int lineno; /* Where it is defined in the file */
+};
+/* Load the links of a links file, one 'port forward_host forward_port'
+ * line per link, followed by its 'key=value' parameters, if any:
+ *
+ *   # port  forward_host  forward_port  parameters
+ *   1341    ::1           12345         delay=20 loss_rate=1
+ *   1342    10.0.0.2      12345         delay=150 rate=2000
+ *
+ * Errors are reported on stderr.
+ * @params: The parameters of the links, before their own ones
+ * @links: Set to the array of links, to be freed with config_free_links()
+ * @n: Set to the number of links
+ * @return: non-zero value on error
+ */
+int config_load_links(const char *path,
+		const struct linksim_params *params,
+		struct config_link **links, size_t *n);
+/* Release links */
+void config_free_links(struct config_link *links, size_t n);
+
+#endif
@@ -0,0 +1,452 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "declog.h"
+
+#include <stdlib.h> /* malloc, realloc, free, qsort */
+#include <stdio.h> /* FILE, fopen, fread */
+#include <string.h> /* memcpy, memcmp, memset */
+#include <stdint.h> /* uint64_t */
+#include <errno.h> /* errno, EINTR */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* write, close */
+#include <signal.h> /* sigset_t, sigfillset */
+#include <pthread.h> /* pthread_create, pthread_mutex_t, pthread_cond_t */
+
+/* File magic, which also tells the version of the format */
+#define MAGIC "LSD1"
+#define MAGIC_LEN 4
+/* Max length of a record: hash, flags, and 4 varints */
+#define MAX_REC_LEN (8 + 1 + 4 * 10)
+/* Initial size of the buffer in which a log is loaded */
+#define IO_BUF_LEN (1 << 20)
+/* The records are appended to one buffer while the writer thread writes the
+ * full ones to the file */
+#define WRITE_BUFS 4
+#define WRITE_BUF_LEN (1 << 18)
+
+/* A recorded decision, when replaying */
+struct entry {
+	uint64_t hash; /* The hash of the packet */
+	int direction; /* Its direction */
+	size_t seq; /* The position of the record in the file */
+	size_t next; /* For the first entry of a packet: how many of its
+					decisions have been replayed */
+	struct linksim_decision d; /* The decision */
+};
+
+/* The buffers of a log being written */
+struct writer {
+	int fd; /* The log file */
+	pthread_t thread; /* Writes the full buffers to fd */
+	pthread_mutex_t lock; /* Protects full, fill and closing */
+	pthread_cond_t cond; /* Signals a change of full or closing */
+	uint8_t *bufs[WRITE_BUFS]; /* The buffers, used as a ring */
+	size_t lens[WRITE_BUFS]; /* How many bytes each buffer holds */
+	size_t fill; /* The buffer receiving the records */
+	size_t full; /* How many buffers before fill are waiting to be written */
+	int closing; /* No more buffers will be filled */
+	int lossy; /* Drop the records rather than wait for the writer */
+	int failed; /* Did a write fail, only read once the thread exited */
+};
+
+struct declog {
+	struct writer *w; /* The log being written, or NULL */
+	size_t count; /* How many records were written, or loaded */
+	size_t dropped; /* How many records were dropped */
+	struct entry *entries; /* The decisions to replay, by packet */
+	size_t misses; /* How many replayed packets were not in the log */
+};
+
+/* 64b FNV-1a hash of a packet */
+static uint64_t hash_pkt(const char *buf, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		h ^= (uint8_t)buf[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* @return: the length of the varint encoding v in buf */
+static size_t put_varint(uint8_t *buf, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	return n;
+}
+
+/* @return: the length of the varint at buf, 0 if it is invalid */
+static size_t get_varint(const uint8_t *buf, size_t len, uint64_t *v)
+{
+	size_t n;
+	*v = 0;
+	for (n = 0; n < len && n < 10; ++n) {
+		*v |= (uint64_t)(buf[n] & 0x7f) << (7 * n);
+		if (!(buf[n] & 0x80))
+			return n + 1;
+	}
+	return 0;
+}
+
+/* Write all of a buffer, retrying on partial writes
+ * @return: non-zero value on error
+ */
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+	while (len) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* The writer thread: write the full buffers in order, until the log is
+ * closed */
+static void *writer_main(void *arg)
+{
+	struct writer *w = arg;
+	size_t i;
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->full && !w->closing)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->full)
+			break;
+		i = (w->fill + WRITE_BUFS - w->full) % WRITE_BUFS;
+		/* The buffer is ours until full is decremented */
+		pthread_mutex_unlock(&w->lock);
+		if (write_all(w->fd, w->bufs[i], w->lens[i]))
+			w->failed = 1;
+		w->lens[i] = 0;
+		pthread_mutex_lock(&w->lock);
+		--w->full;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Hand the buffer being filled to the writer thread, and start filling the
+ * next one
+ * @wait: wait for a buffer to be free rather than failing
+ * @return: non-zero value if all the buffers are full
+ */
+static int writer_rotate(struct writer *w, int wait)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->full + 1 == WRITE_BUFS) {
+		if (!wait) {
+			pthread_mutex_unlock(&w->lock);
+			return -1;
+		}
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	++w->full;
+	w->fill = (w->fill + 1) % WRITE_BUFS;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+static void writer_free(struct writer *w)
+{
+	size_t i;
+	for (i = 0; i < WRITE_BUFS; ++i)
+		free(w->bufs[i]);
+	free(w);
+}
+
+/* Flush the buffered records and stop the writer thread
+ * @return: non-zero value if some records could not be written
+ */
+static int writer_close(struct writer *w)
+{
+	int err;
+	if (w->lens[w->fill])
+		writer_rotate(w, 1);
+	pthread_mutex_lock(&w->lock);
+	w->closing = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	err = w->failed;
+	if (close(w->fd))
+		err = 1;
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	writer_free(w);
+	return err;
+}
+
+declog_t *declog_open_write(const char *path, int lossy)
+{
+	declog_t *l;
+	struct writer *w;
+	sigset_t all, old;
+	size_t i;
+	int err;
+	if (!(l = calloc(1, sizeof(*l))))
+		return NULL;
+	if (!(l->w = w = calloc(1, sizeof(*w))))
+		goto fail_log;
+	for (i = 0; i < WRITE_BUFS; ++i)
+		if (!(w->bufs[i] = malloc(WRITE_BUF_LEN)))
+			goto fail_bufs;
+	w->lossy = lossy;
+	if ((w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+					0644)) < 0)
+		goto fail_bufs;
+	memcpy(w->bufs[0], MAGIC, MAGIC_LEN);
+	w->lens[0] = MAGIC_LEN;
+	if ((err = pthread_mutex_init(&w->lock, NULL)))
+		goto fail_fd;
+	if ((err = pthread_cond_init(&w->cond, NULL)))
+		goto fail_lock;
+	/* Leave the signals, e.g. SIGINT, to the thread running the link */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&w->thread, NULL, writer_main, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+		goto fail_cond;
+	return l;
+
+fail_cond:
+	pthread_cond_destroy(&w->cond);
+fail_lock:
+	pthread_mutex_destroy(&w->lock);
+fail_fd:
+	close(w->fd);
+	errno = err;
+fail_bufs:
+	writer_free(w);
+fail_log:
+	free(l);
+	return NULL;
+}
+
+void declog_record(void *arg, const char *buf, size_t len, int direction,
+		const struct linksim_decision *d)
+{
+	declog_t *l = arg;
+	uint8_t rec[MAX_REC_LEN];
+	uint64_t h = hash_pkt(buf, len);
+	size_t n, i;
+	for (i = 0; i < 8; ++i)
+		rec[i] = h >> (8 * i);
+	rec[8] = (direction & 3) | (d->flags << 2);
+	n = 9;
+	if (d->flags & LINKSIM_DEC_CUT)
+		n += put_varint(rec + n, d->cut_len);
+	if (d->flags & LINKSIM_DEC_CORRUPT)
+		n += put_varint(rec + n, d->corrupt_idx);
+	if (d->flags & LINKSIM_DEC_FLIP)
+		n += put_varint(rec + n, d->flip_seed);
+	if (d->flags & LINKSIM_DEC_DELAY)
+		n += put_varint(rec + n, d->delay);
+	/* Never wait for the disk in the data path, unless asked to: drop the
+	 * record if the writer thread lags behind */
+	if (l->w->lens[l->w->fill] + n > WRITE_BUF_LEN &&
+			writer_rotate(l->w, !l->w->lossy)) {
+		++l->dropped;
+		return;
+	}
+	memcpy(l->w->bufs[l->w->fill] + l->w->lens[l->w->fill], rec, n);
+	l->w->lens[l->w->fill] += n;
+	++l->count;
+}
+
+/* Order the entries by packet, then by position in the file */
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *left = a, *right = b;
+	if (left->hash != right->hash)
+		return left->hash < right->hash ? -1 : 1;
+	if (left->direction != right->direction)
+		return left->direction - right->direction;
+	return left->seq < right->seq ? -1 : left->seq > right->seq;
+}
+
+/* Parse the records of a log
+ * @return: non-zero value if the log is invalid */
+static int parse_records(declog_t *l, const uint8_t *buf, size_t len)
+{
+	struct entry *e, *tmp;
+	size_t alloc = 0, off = MAGIC_LEN, n, i;
+	uint64_t v;
+	while (off < len) {
+		if (len - off < 9)
+			return -1;
+		if (l->count == alloc) {
+			alloc = alloc ? alloc << 1 : 1024;
+			if (!(tmp = realloc(l->entries, alloc * sizeof(*tmp))))
+				return -1;
+			l->entries = tmp;
+		}
+		e = &l->entries[l->count];
+		memset(e, 0, sizeof(*e));
+		for (i = 0; i < 8; ++i)
+			e->hash |= (uint64_t)buf[off + i] << (8 * i);
+		e->direction = buf[off + 8] & 3;
+		e->d.flags = buf[off + 8] >> 2;
+		e->seq = l->count;
+		off += 9;
+		if (e->d.flags & LINKSIM_DEC_CUT) {
+			if (!(n = get_varint(buf + off, len - off, &v)))
+				return -1;
+			e->d.cut_len = v;
+			off += n;
+		}
+		if (e->d.flags & LINKSIM_DEC_CORRUPT) {
+			if (!(n = get_varint(buf + off, len - off, &v)))
+				return -1;
+			e->d.corrupt_idx = v;
+			off += n;
+		}
+		if (e->d.flags & LINKSIM_DEC_FLIP) {
+			if (!(n = get_varint(buf + off, len - off, &v)))
+				return -1;
+			e->d.flip_seed = v;
+			off += n;
+		}
+		if (e->d.flags & LINKSIM_DEC_DELAY) {
+			if (!(n = get_varint(buf + off, len - off, &v)))
+				return -1;
+			e->d.delay = v;
+			off += n;
+		}
+		++l->count;
+	}
+	/* The decisions for a packet are now contiguous, in recording order */
+	qsort(l->entries, l->count, sizeof(*l->entries), entry_cmp);
+	return 0;
+}
+
+declog_t *declog_open_read(const char *path)
+{
+	declog_t *l = NULL;
+	uint8_t *buf = NULL;
+	size_t len = 0, alloc = 0, n;
+	FILE *f;
+	if (!(f = fopen(path, "rb")))
+		return NULL;
+	/* Load the whole log */
+	do {
+		uint8_t *tmp;
+		if (len == alloc) {
+			alloc = alloc ? alloc << 1 : IO_BUF_LEN;
+			if (!(tmp = realloc(buf, alloc)))
+				goto fail;
+			buf = tmp;
+		}
+		n = fread(buf + len, 1, alloc - len, f);
+		len += n;
+	} while (n);
+	if (ferror(f) || len < MAGIC_LEN || memcmp(buf, MAGIC, MAGIC_LEN))
+		goto fail;
+	if (!(l = calloc(1, sizeof(*l))))
+		goto fail;
+	if (parse_records(l, buf, len)) {
+		declog_close(l);
+		l = NULL;
+	}
+fail:
+	free(buf);
+	fclose(f);
+	return l;
+}
+
+int declog_replay(void *arg, const char *buf, size_t len, int direction,
+		struct linksim_decision *d)
+{
+	declog_t *l = arg;
+	struct entry key, *first;
+	size_t lo = 0, hi = l->count, mid;
+	key.hash = hash_pkt(buf, len);
+	key.direction = direction;
+	key.seq = 0;
+	/* Find the first decision recorded for the packet */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entry_cmp(&l->entries[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* Then the one for this occurrence of the packet */
+	if (lo < l->count) {
+		first = &l->entries[lo];
+		if (lo + first->next < l->count &&
+				first[first->next].hash == key.hash &&
+				first[first->next].direction == direction) {
+			*d = first[first->next++].d;
+			return 1;
+		}
+	}
+	/* Unknown packet, or seen more often than when recording: let the link
+	 * decide */
+	++l->misses;
+	return 0;
+}
+
+int declog_close(declog_t *l)
+{
+	int err = 0;
+	if (!l)
+		return 0;
+	if (l->w)
+		err = writer_close(l->w);
+	free(l->entries);
+	free(l);
+	return err ? -1 : 0;
+}
+
+size_t declog_size(const declog_t *l)
+{
+	return l->count;
+}
+
+size_t declog_dropped(const declog_t *l)
+{
+	return l->dropped;
+}
+
+size_t declog_misses(const declog_t *l)
+{
+	return l->misses;
+}
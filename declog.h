@@ -0,0 +1,76 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __DECLOG_H_
+#define __DECLOG_H_
+
+#include <stddef.h> /* size_t */
+
+#include "linksim.h" /* linksim_decision */
+
+/* Decision logs: a compact binary record of what the link did to each
+ * packet, keyed by the content of the packet, and of its direction. When
+ * replayed, a packet gets the decision recorded for the same packet,
+ * regardless of the order in which the packets arrive. Identical packets
+ * (e.g. retransmissions) get the recorded decisions in turn.
+ *
+ * The file starts with the magic "LSD1", followed by one record per packet:
+ * the 64b FNV-1a hash of the packet (little-endian), a byte holding the
+ * direction (2 low bits) and the LINKSIM_DEC_X flags (shifted by 2), then,
+ * depending on the flags, the cut length, the index of the corrupted byte,
+ * the seed of the flipped bits and the delay, as LEB128 varints.
+ */
+
+typedef struct declog declog_t;
+
+/* Create a decision log, to record the decisions of a link. The records
+ * are buffered, and written to the file by a separate thread.
+ * @lossy: drop the records that do not fit in the buffers, rather than
+ *         wait for the thread to write them
+ * @return: NULL on error
+ */
+declog_t *declog_open_write(const char *path, int lossy);
+/* Load a decision log, to replay it
+ * @return: NULL on error
+ */
+declog_t *declog_open_read(const char *path);
+/* Close a decision log, writing the records still buffered
+ * @return: non-zero value if some records could not be written
+ */
+int declog_close(declog_t*);
+/* The hooks to install in a link with linksim_set_decider(), arg being the
+ * declog_t */
+void declog_record(void *arg, const char *buf, size_t len, int direction,
+		const struct linksim_decision *d);
+int declog_replay(void *arg, const char *buf, size_t len, int direction,
+		struct linksim_decision *d);
+/* @return: the number of decisions recorded, or available to replay */
+size_t declog_size(const declog_t*);
+/* @return: the number of records dropped as the buffers were full */
+size_t declog_dropped(const declog_t*);
+/* @return: the number of replayed packets that were not in the log */
+size_t declog_misses(const declog_t*);
+
+#endif
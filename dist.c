@@ -0,0 +1,181 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "dist.h"
+
+#include <stdlib.h> /* malloc, free, qsort */
+#include <math.h> /* erfc, pow, sqrt */
+
+#include "linksim.h" /* LINKSIM_DIST_X */
+
+/* The shape of the Pareto distribution, whose variance is finite above 2 */
+#define PARETO_SHAPE 3.0
+/* Quantiles of each part of the Pareto-normal distribution that are mixed
+ * to tabulate it */
+#define MIX_POINTS 256
+
+/* A value of a distribution, and how often it occurs */
+struct point {
+	double value;
+	double weight;
+};
+
+/* @return: the probability of the i-th of n quantiles, which sit in the
+ *          middle of their share of ]0, 1[ so that the tails are finite */
+static inline double quantile_prob(size_t i, size_t n)
+{
+	return (i + .5) / n;
+}
+
+/* @return: the quantile of the standard normal distribution at p */
+static double normal_quantile(double p)
+{
+	double lo = -40, hi = 40, mid;
+	int i;
+	/* The CDF has no closed-form inverse, bisect it */
+	for (i = 0; i < 64; ++i) {
+		mid = (lo + hi) / 2;
+		if (.5 * erfc(-mid / sqrt(2)) < p)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo + hi) / 2;
+}
+
+/* @return: the quantile at p of the Pareto distribution of scale 1,
+ *          standardized */
+static double pareto_quantile(double p)
+{
+	const double a = PARETO_SHAPE;
+	double mean = a / (a - 1), sd = sqrt(a / (a - 2)) / (a - 1);
+	return (pow(1 - p, -1 / a) - mean) / sd;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+	double x = ((const struct point*)a)->value;
+	double y = ((const struct point*)b)->value;
+	return (x > y) - (x < y);
+}
+
+/* Tabulate the distribution of n points of positive weight, sorted in-place.
+ * Each point sits in the middle of its share of the total weight, and the
+ * quantiles between two points are interpolated. */
+static float *table_from_points(struct point *pts, size_t n)
+{
+	double total = 0, mean = 0, var = 0, sd, cum = 0, mid, next, target, x;
+	float *t;
+	size_t i, k = 0;
+	for (i = 0; i < n; ++i) {
+		total += pts[i].weight;
+		mean += pts[i].weight * pts[i].value;
+	}
+	if (!n || !(total > 0) || !(t = malloc(DIST_TABLE_LEN * sizeof(*t))))
+		return NULL;
+	mean /= total;
+	for (i = 0; i < n; ++i)
+		var += pts[i].weight * (pts[i].value - mean) *
+			(pts[i].value - mean);
+	sd = sqrt(var / total);
+	qsort(pts, n, sizeof(*pts), point_cmp);
+	for (i = 0; i < DIST_TABLE_LEN; ++i) {
+		target = quantile_prob(i, DIST_TABLE_LEN) * total;
+		/* The quantiles are increasing, so is the point below them */
+		while (k + 1 < n &&
+				cum + pts[k].weight + pts[k + 1].weight / 2 <= target)
+			cum += pts[k++].weight;
+		mid = cum + pts[k].weight / 2;
+		next = cum + pts[k].weight + (k + 1 < n ? pts[k + 1].weight / 2 : 0);
+		if (target <= mid || k + 1 == n)
+			x = pts[k].value;
+		else
+			x = pts[k].value + (pts[k + 1].value - pts[k].value) *
+				(target - mid) / (next - mid);
+		/* A constant distribution does not vary around its mean */
+		t[i] = sd > 0 ? (float)((x - mean) / sd) : 0;
+	}
+	return t;
+}
+
+float *dist_table_new(int dist)
+{
+	double normal[MIX_POINTS], pareto[MIX_POINTS], p;
+	struct point *pts;
+	float *t;
+	size_t i, j;
+	switch (dist) {
+		case LINKSIM_DIST_NORMAL:
+		case LINKSIM_DIST_PARETO:
+			if (!(t = malloc(DIST_TABLE_LEN * sizeof(*t))))
+				return NULL;
+			for (i = 0; i < DIST_TABLE_LEN; ++i) {
+				p = quantile_prob(i, DIST_TABLE_LEN);
+				t[i] = dist == LINKSIM_DIST_NORMAL ? normal_quantile(p) :
+					pareto_quantile(p);
+			}
+			return t;
+		case LINKSIM_DIST_PARETONORMAL:
+			/* As netem, a quarter of normal and three quarters of Pareto,
+			 * whose sum is tabulated from all pairs of their quantiles */
+			if (!(pts = malloc(MIX_POINTS * MIX_POINTS * sizeof(*pts))))
+				return NULL;
+			for (i = 0; i < MIX_POINTS; ++i) {
+				normal[i] = normal_quantile(quantile_prob(i, MIX_POINTS));
+				pareto[i] = pareto_quantile(quantile_prob(i, MIX_POINTS));
+			}
+			for (i = 0; i < MIX_POINTS; ++i)
+				for (j = 0; j < MIX_POINTS; ++j) {
+					pts[i * MIX_POINTS + j].value =
+						.25 * normal[i] + .75 * pareto[j];
+					pts[i * MIX_POINTS + j].weight = 1;
+				}
+			t = table_from_points(pts, MIX_POINTS * MIX_POINTS);
+			free(pts);
+			return t;
+		default:
+			return NULL;
+	}
+}
+
+float *dist_table_from_histogram(const double *values, const double *weights,
+		size_t n)
+{
+	struct point *pts;
+	float *t;
+	size_t i, count = 0;
+	if (!n || !(pts = malloc(n * sizeof(*pts))))
+		return NULL;
+	/* Values that never occur would only split the quantiles */
+	for (i = 0; i < n; ++i) {
+		if (!(weights[i] > 0))
+			continue;
+		pts[count].value = values[i];
+		pts[count++].weight = weights[i];
+	}
+	t = table_from_points(pts, count);
+	free(pts);
+	return t;
+}
@@ -0,0 +1,68 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#ifndef __DIST_H_
+#define __DIST_H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint32_t */
+
+/* Delay distributions, tabulated as their inverse CDF so that drawing a
+ * sample costs a lookup and an interpolation, whatever the distribution.
+ * The tables hold standardized distributions (mean 0, standard deviation 1),
+ * to be scaled by the caller.
+ */
+
+/* The tables have 2^DIST_TABLE_BITS intervals */
+#define DIST_TABLE_BITS 12
+#define DIST_TABLE_LEN ((1 << DIST_TABLE_BITS) + 1)
+
+/* Tabulate a built-in distribution, one of LINKSIM_DIST_NORMAL, _PARETO or
+ * _PARETONORMAL
+ * @return: the table, to be freed, NULL on error
+ */
+float *dist_table_new(int dist);
+/* Tabulate the distribution of a histogram
+ * @values: The values, in any order
+ * @weights: How often each value occurs, >= 0
+ * @n: The number of values
+ * @return: the table, to be freed, NULL on error or if the histogram is
+ *          empty
+ */
+float *dist_table_from_histogram(const double *values, const double *weights,
+		size_t n);
+
+/* @return: the sample of the distribution tabulated in t at u, which is
+ *          uniform over 32b */
+static inline double dist_sample(const float *t, uint32_t u)
+{
+	uint32_t i = u >> (32 - DIST_TABLE_BITS);
+	float frac = (u & ((1U << (32 - DIST_TABLE_BITS)) - 1)) *
+		(1.0f / (1U << (32 - DIST_TABLE_BITS)));
+	return t[i] + (t[i + 1] - t[i]) * frac;
+}
+
+#endif
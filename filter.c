@@ -0,0 +1,368 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "linksim.h"
+
+#include <stdlib.h> /* malloc, realloc, free, strtoul */
+#include <string.h> /* strncmp, strspn */
+#include <ctype.h> /* isspace, isalpha, isdigit */
+#include <stdarg.h> /* va_list */
+
+/* The filters are compiled to a small stack machine. The bytecode is a flat
+ * array of instructions, with forward jumps to short-circuit the boolean
+ * operators, so that matching a packet is a single pass over it, without
+ * any allocation nor recursion. */
+
+/* Max depth of the stack of the machine */
+#define FILTER_MAX_STACK 16
+
+enum filter_op {
+	OP_IMM, /* Push k */
+	OP_LEN, /* Push the length of the packet */
+	OP_DIR, /* Push the direction of the packet */
+	OP_LDB, /* Push the byte at offset k */
+	OP_LDH, /* Push the 16b big-endian word at offset k */
+	OP_LDW, /* Push the 32b big-endian word at offset k */
+	OP_AND, /* top &= k */
+	OP_SHR, /* top >>= k */
+	OP_EQ, /* Pop b, a, push a == b, ... */
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+	OP_NOT, /* top = !top */
+	OP_JF, /* If top is 0, jump to k, otherwise pop */
+	OP_JT, /* If top is not 0, jump to k, otherwise pop */
+	OP_RET, /* Match iff top is not 0 */
+};
+
+struct insn {
+	uint8_t op; /* One of OP_X */
+	uint32_t k; /* Its argument */
+};
+
+struct linksim_filter {
+	size_t len; /* Number of instructions */
+	struct insn code[]; /* The program */
+};
+
+/* The state of the compiler */
+struct compiler {
+	const char *src; /* The expression */
+	const char *pos; /* Where the next token starts */
+	struct insn *code; /* The program being emitted */
+	size_t len, alloc; /* Number of instructions, and room for them */
+	int depth, max_depth; /* Depth of the stack after the last instruction */
+	int failed; /* Has an error been reported yet */
+	char *err; /* Where to report errors */
+	size_t err_len;
+};
+
+/* Report a compilation error, only the first one is kept */
+static void error(struct compiler *c, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	if (c->failed)
+		return;
+	c->failed = 1;
+	if (!c->err_len)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(c->err, c->err_len, fmt, ap);
+	va_end(ap);
+	if (n >= 0 && (size_t)n < c->err_len)
+		snprintf(c->err + n, c->err_len - n, " at offset %d",
+				(int)(c->pos - c->src));
+}
+
+/* Append an instruction, tracking the depth of the stack
+ * @effect: How many values it adds to the stack
+ * @return: its index */
+static size_t emit(struct compiler *c, enum filter_op op, uint32_t k,
+		int effect)
+{
+	struct insn *tmp;
+	if (c->failed)
+		return 0;
+	if (c->len == c->alloc) {
+		if (!(tmp = realloc(c->code, (c->alloc ? c->alloc << 1 : 16) *
+						sizeof(*tmp)))) {
+			error(c, "out of memory");
+			return 0;
+		}
+		c->code = tmp;
+		c->alloc = c->alloc ? c->alloc << 1 : 16;
+	}
+	c->code[c->len].op = op;
+	c->code[c->len].k = k;
+	if ((c->depth += effect) > c->max_depth)
+		c->max_depth = c->depth;
+	if (c->max_depth > FILTER_MAX_STACK)
+		error(c, "expression too complex");
+	return c->len++;
+}
+
+static void skip_spaces(struct compiler *c)
+{
+	while (isspace((unsigned char)*c->pos))
+		++c->pos;
+}
+
+/* Consume the token tok if it comes next */
+static int accept(struct compiler *c, const char *tok)
+{
+	size_t n = strlen(tok);
+	skip_spaces(c);
+	if (strncmp(c->pos, tok, n))
+		return 0;
+	/* Keywords must not be the prefix of a longer word */
+	if (isalpha((unsigned char)tok[0]) &&
+			(isalnum((unsigned char)c->pos[n]) || c->pos[n] == '_'))
+		return 0;
+	c->pos += n;
+	return 1;
+}
+
+static void expect(struct compiler *c, const char *tok)
+{
+	if (!accept(c, tok))
+		error(c, "expected '%s'", tok);
+}
+
+static uint32_t number(struct compiler *c)
+{
+	char *end;
+	unsigned long v;
+	skip_spaces(c);
+	if (!isdigit((unsigned char)*c->pos)) {
+		error(c, "expected a number");
+		return 0;
+	}
+	v = strtoul(c->pos, &end, 0);
+	if (v > UINT32_MAX)
+		error(c, "number too large");
+	c->pos = end;
+	return v;
+}
+
+/* value := atom { '&' number | '>>' number } */
+static void value(struct compiler *c)
+{
+	static const struct {
+		const char *name;
+		enum filter_op op;
+	} loads[] = { { "byte", OP_LDB }, { "u16", OP_LDH }, { "u32", OP_LDW } };
+	size_t i;
+	skip_spaces(c);
+	if (isdigit((unsigned char)*c->pos)) {
+		emit(c, OP_IMM, number(c), 1);
+	} else if (accept(c, "len")) {
+		emit(c, OP_LEN, 0, 1);
+	} else if (accept(c, "dir")) {
+		emit(c, OP_DIR, 0, 1);
+	} else if (accept(c, "forward")) {
+		emit(c, OP_IMM, LINK_FORWARD, 1);
+	} else if (accept(c, "reverse")) {
+		emit(c, OP_IMM, LINK_REVERSE, 1);
+	} else {
+		for (i = 0; i < sizeof(loads) / sizeof(*loads); ++i)
+			if (accept(c, loads[i].name))
+				break;
+		if (i == sizeof(loads) / sizeof(*loads)) {
+			error(c, "expected a value");
+			return;
+		}
+		expect(c, "[");
+		emit(c, loads[i].op, number(c), 1);
+		expect(c, "]");
+	}
+	for (;;) {
+		skip_spaces(c);
+		/* Do not mistake '&&' for a mask */
+		if (c->pos[0] == '&' && c->pos[1] != '&' && accept(c, "&"))
+			emit(c, OP_AND, number(c), 0);
+		else if (accept(c, ">>"))
+			emit(c, OP_SHR, number(c), 0);
+		else
+			break;
+	}
+}
+
+static void or_expr(struct compiler *c);
+
+/* unary := '!' unary | '(' or_expr ')' | value [ cmp value ] */
+static void unary(struct compiler *c)
+{
+	static const struct {
+		const char *tok;
+		enum filter_op op;
+	} cmps[] = { /* Longest operators first */
+		{ "==", OP_EQ }, { "!=", OP_NE }, { "<=", OP_LE }, { ">=", OP_GE },
+		{ "<", OP_LT }, { ">", OP_GT },
+	};
+	size_t i;
+	if (c->failed)
+		return;
+	if (accept(c, "!") || accept(c, "not")) {
+		unary(c);
+		emit(c, OP_NOT, 0, 0);
+		return;
+	}
+	if (accept(c, "(")) {
+		or_expr(c);
+		expect(c, ")");
+		return;
+	}
+	value(c);
+	/* A value alone is true if it is not 0 */
+	for (i = 0; i < sizeof(cmps) / sizeof(*cmps); ++i) {
+		if (accept(c, cmps[i].tok)) {
+			value(c);
+			emit(c, cmps[i].op, 0, -1);
+			break;
+		}
+	}
+}
+
+/* Compile a chain of operands joined by a short-circuit operator
+ * @jump: OP_JF for a conjunction, OP_JT for a disjunction */
+static void chain(struct compiler *c, void (*operand)(struct compiler*),
+		const char *tok, const char *word, enum filter_op jump)
+{
+	size_t jumps[FILTER_MAX_STACK * 4], n = 0, i;
+	operand(c);
+	while (!c->failed && (accept(c, tok) || accept(c, word))) {
+		if (n == sizeof(jumps) / sizeof(*jumps)) {
+			error(c, "expression too long");
+			return;
+		}
+		/* The result is known if the operand is (resp. is not) 0 */
+		jumps[n++] = emit(c, jump, 0, -1);
+		operand(c);
+	}
+	/* Jump past the whole chain */
+	for (i = 0; i < n && !c->failed; ++i)
+		c->code[jumps[i]].k = c->len;
+}
+
+/* and_expr := unary { '&&' unary } */
+static void and_expr(struct compiler *c)
+{
+	chain(c, unary, "&&", "and", OP_JF);
+}
+
+/* or_expr := and_expr { '||' and_expr } */
+static void or_expr(struct compiler *c)
+{
+	chain(c, and_expr, "||", "or", OP_JT);
+}
+
+linksim_filter_t *linksim_filter_compile(const char *expr, char *err,
+		size_t err_len)
+{
+	struct compiler c;
+	linksim_filter_t *f = NULL;
+	memset(&c, 0, sizeof(c));
+	c.src = c.pos = expr;
+	c.err = err;
+	c.err_len = err_len;
+	or_expr(&c);
+	skip_spaces(&c);
+	if (*c.pos)
+		error(&c, "unexpected '%c'", *c.pos);
+	emit(&c, OP_RET, 0, 0);
+	if (!c.failed) {
+		if ((f = malloc(sizeof(*f) + c.len * sizeof(*c.code)))) {
+			f->len = c.len;
+			memcpy(f->code, c.code, c.len * sizeof(*c.code));
+		} else {
+			error(&c, "out of memory");
+		}
+	}
+	free(c.code);
+	return f;
+}
+
+void linksim_filter_del(linksim_filter_t *f)
+{
+	free(f);
+}
+
+int linksim_filter_match(const linksim_filter_t *f, const char *buf,
+		size_t len, int direction)
+{
+	const uint8_t *b = (const uint8_t*)buf;
+	uint32_t stack[FILTER_MAX_STACK];
+	const struct insn *i;
+	int sp = -1;
+	/* Fields beyond the end of the packet do not match */
+	for (i = f->code;; ++i) {
+		switch (i->op) {
+			case OP_IMM: stack[++sp] = i->k; break;
+			case OP_LEN: stack[++sp] = len; break;
+			case OP_DIR: stack[++sp] = direction; break;
+			case OP_LDB:
+				if (i->k >= len) return 0;
+				stack[++sp] = b[i->k];
+				break;
+			case OP_LDH:
+				if (len < 2 || i->k > len - 2) return 0;
+				stack[++sp] = (uint32_t)b[i->k] << 8 | b[i->k + 1];
+				break;
+			case OP_LDW:
+				if (len < 4 || i->k > len - 4) return 0;
+				stack[++sp] = (uint32_t)b[i->k] << 24 |
+					(uint32_t)b[i->k + 1] << 16 |
+					(uint32_t)b[i->k + 2] << 8 | b[i->k + 3];
+				break;
+			case OP_AND: stack[sp] &= i->k; break;
+			case OP_SHR: stack[sp] = i->k < 32 ? stack[sp] >> i->k : 0; break;
+			case OP_EQ: --sp; stack[sp] = stack[sp] == stack[sp + 1]; break;
+			case OP_NE: --sp; stack[sp] = stack[sp] != stack[sp + 1]; break;
+			case OP_LT: --sp; stack[sp] = stack[sp] < stack[sp + 1]; break;
+			case OP_LE: --sp; stack[sp] = stack[sp] <= stack[sp + 1]; break;
+			case OP_GT: --sp; stack[sp] = stack[sp] > stack[sp + 1]; break;
+			case OP_GE: --sp; stack[sp] = stack[sp] >= stack[sp + 1]; break;
+			case OP_NOT: stack[sp] = !stack[sp]; break;
+			case OP_JF:
+				if (!stack[sp])
+					i = f->code + i->k - 1;
+				else
+					--sp;
+				break;
+			case OP_JT:
+				if (stack[sp])
+					i = f->code + i->k - 1;
+				else
+					--sp;
+				break;
+			case OP_RET:
+			default:
+				return stack[sp] != 0;
+		}
+	}
+}
@@ -25,7 +25,8 @@ SOFTWARE.
 #include <stdlib.h> /* malloc, free, EXIT_X, ...*/
 #include <stdio.h> /* printf, fprintf, recvfrom */
 #include <unistd.h> /* getopt */
-#include <netinet/in.h> /* sockaddr_in6 */
+#include <netinet/in.h> /* sockaddr_in6, sockaddr_in */
+#include <netdb.h> /* getaddrinfo */
 #include <sys/types.h> /* in6_addr */
 #include <sys/socket.h> /* socket, bind, connect */
 #include <sys/select.h> /* fd_set, select */
@@ -33,84 +34,216 @@ SOFTWARE.
 	#include <sys/time.h> /* gettimeofday */
 #endif
 #include <time.h> /* clock_gettime, time */
-#include <string.h> /* memcpy, memcmp */
+#include <string.h> /* memcpy, memcmp, strerror */
 #include <errno.h> /* errno, EAGAIN, ... */
+#include <ctype.h> /* isspace */
 #include <fcntl.h> /* fcntl */
 #include <arpa/inet.h> /* inet_ntop */
 #include <limits.h> /* INT_MAX, SHRT_MAX */
 #include <stdint.h> /* uint8_t */
+#include <inttypes.h> /* PRIu64 */
+#include <signal.h> /* sigaction, sig_atomic_t */
+#include <sys/mman.h> /* mmap, munmap */
+#include <sys/stat.h> /* fstat */
+#include <sys/uio.h> /* iovec */
+#include <netinet/udp.h> /* UDP_SEGMENT, UDP_GRO */
+#ifdef __linux__
+	#include <asm/socket.h> /* SO_BUSY_POLL, SO_TXTIME */
+	#include <linux/net_tstamp.h> /* sock_txtime */
+#endif
 
-#include "min_queue.h" /* minq_x */
-
-/* Min packet length in the protocol */
-#define MIN_PKT_LEN 10
-/* Min packet length of a data packet in the protocol */
-#define MIN_PKT_PDATA_LEN 12
-/* Position of the length bit in the header */
-#define LENGTH_FIELD_LENGTH_BIT_POS 8
-
-/*
- * Max packet length in the protocol (packet with max header size +
- * max payload size + CRC2 size
- */
-#define MAX_PKT_LEN (MIN_PKT_LEN + 2 + 512 + 4)
-/* Random number between 0 and 100 */
-#define RAND_PERCENT ((unsigned int)(rand() % 101))
+#include "linksim.h" /* linksim_x */
+#include "pcap.h" /* pcap_x */
+#include "config.h" /* config_x */
+#include "declog.h" /* declog_x */
+#include "realtime.h" /* rt_x */
 
-/* Link directions*/
-#define LINK_FORWARD 1
-#define LINK_REVERSE 2
-#define LINK_BOTH_WAYS (LINK_FORWARD | LINK_REVERSE)
-#define SAME_DIRECTION(x, y) (x & y)
-static inline const char* get_link_direction(int x)
-{
-	switch (x) {
-		case LINK_FORWARD: return "Forward";
-		case LINK_REVERSE: return "Reverse";
-		case LINK_BOTH_WAYS: return "Both ways";
-		default: return "Unknown";
-	}
-}
+/* Max packet length in the protocol, the default max datagram size */
+#define MAX_PKT_LEN LINKSIM_MAX_PKT_LEN
+/* Max payload of a UDP datagram (over IPv6, without jumbograms) */
+#define MAX_UDP_PAYLOAD 65527
+/* Max number of datagrams sent at once with UDP GSO */
+#define MAX_GSO_SEGS 64
+/* Max size of a packet coalesced by UDP GRO */
+#define MAX_GRO_LEN 65535
+/* Datagrams kept per direction when the socket cannot send them right
+ * away, unless -Q tells how many */
+#define DEFAULT_BACKLOG_LEN 64
+/* Packets preallocated with -L, unless -q tells how many */
+#define DEFAULT_POOL_LEN 1024
+#if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+	#define HAVE_UDP_GSO
+#endif
+#if defined(__linux__) && defined(SO_TXTIME)
+	#define HAVE_TXTIME
+#endif
+#if defined(SO_TIMESTAMPNS) && !defined(__APPLE__)
+	#define HAVE_RX_TIMESTAMPS
+#endif
+#ifndef SO_RCVBUFFORCE /* Only Linux lets privileged users exceed limits */
+	#define SO_RCVBUFFORCE -1
+	#define SO_SNDBUFFORCE -1
+#endif
 
 int forward_port = 12345;
 int port = 1341;
-unsigned int delay = 0;
-unsigned int jitter = 0;
-unsigned int err_rate = 0;
-unsigned int cut_rate = 0;
-unsigned int loss_rate = 0;
-int link_direction = LINK_FORWARD;
-int sfd = -1; /* socket file des. */
-minqueue_t *pkt_queue = NULL; /* Queue for delayed packet */
+struct linksim_params params; /* The parameters set on the cmd line */
+const char *config_path = NULL; /* File to (re)load parameters from */
+const char *schedule_path = NULL; /* File describing how params change */
+const char *links_path = NULL; /* File defining the links to simulate */
 struct timeval last_clock; /* Cache current timestamp */
-struct sockaddr_in6 dest_addr, src_addr; /* The addresses of the 2 parties */
-int has_source_addr = 0; /* Have we seen the other party yet */
-
-struct pkt_slot { /* One entry in the packet queue */
-	struct timeval ts; /* Expiration date */
-	int direction; /* The direction of the packet */
-	int size; /* How many bytes are used in buf */
-	char buf[MAX_PKT_LEN]; /* The packet data */
+/* A party of the connection: its address as compared, IPv4 addresses being
+ * mapped in IPv6 (::ffff:a.b.c.d), and as given to the socket */
+struct peer {
+	struct sockaddr_in6 addr;
+	union {
+		struct sockaddr_in6 in6;
+		struct sockaddr_in in;
+	} wire;
+	socklen_t wire_len;
+};
+const char *forward_host = "::1"; /* Where the traffic is forwarded */
+/* The family of the sockets: IPv6, reaching IPv4 hosts as well, unless the
+ * system only has IPv4 */
+int sock_family = AF_INET6;
+size_t queue_capacity = 0; /* How many slots to preallocate in the link */
+size_t max_pkt_len = MAX_PKT_LEN; /* Larger datagrams are truncated */
+/* The protocol relayed over the link */
+const struct linksim_proto *proto = &linksim_proto_trtp;
+/* Room for a received datagram, or to rebuild a frame in offline mode */
+char *pkt_buf = NULL;
+size_t rx_len; /* How many bytes of pkt_buf can be received at once */
+int use_gso = 0; /* Receive and send batches of datagrams (-g) */
+/* Date the received packets with their arrival in the kernel */
+int rx_timestamps = 0;
+/* The socket buffer sizes (-B, -O), 0 to keep those of the system */
+int rcvbuf_len = 0, sndbuf_len = 0;
+
+struct tx_batch { /* Consecutive datagrams to send at once, with UDP GSO */
+	int direction; /* Where they are sent */
+	struct timeval ts; /* When they are sent, used in offline mode and
+						 with SO_TXTIME */
+	size_t seg_len; /* The length of all of them but the last one */
+	size_t len; /* Their total length */
+	size_t n; /* How many datagrams are batched */
+	struct iovec iov[MAX_GSO_SEGS]; /* The datagrams */
+};
+struct tx_backlog { /* Datagrams forwarded right away that the socket could
+					   not send yet, kept in order until it is writable */
+	char *slots; /* backlog_len slots of max_pkt_len bytes */
+	size_t *lens; /* The length of the datagram in each slot */
+	struct timeval *dates; /* When each datagram leaves, with SO_TXTIME */
+	size_t head; /* The slot of the oldest datagram */
+	size_t count; /* How many datagrams are kept */
+	size_t queued, dropped, peak; /* Statistics */
 };
+struct tx_state { /* Delivery of the delayed packets, per direction */
+	int blocked; /* Is the direction waiting for the socket to be writable */
+	size_t sent; /* How many delayed packets were sent */
+	uint64_t late_us, late_max_us; /* Total and max lateness of those */
+	size_t late; /* How many were sent more than 1 ms after their date */
+};
+size_t backlog_len = DEFAULT_BACKLOG_LEN; /* Max datagrams per backlog */
+const char *pcap_in_path = NULL; /* Offline mode: capture to replay */
+const char *pcap_out_path = NULL; /* Offline mode: resulting capture */
+pcap_file_t *pcap_in = NULL, *pcap_out = NULL; /* The open captures */
+volatile sig_atomic_t stop_requested = 0; /* Set on SIGINT/SIGTERM */
+volatile sig_atomic_t reload_requested = 0; /* Set on SIGHUP */
+
+struct frame_template { /* Offline mode: headers to rebuild frames from */
+	int valid; /* Have we seen a frame in that direction yet */
+	struct pcap_udp udp; /* Location of the UDP payload */
+	uint8_t hdr[PCAP_MAX_HDR_LEN]; /* The headers of the first frame */
+};
+struct trace_file { /* A delivery trace, mapped in memory */
+	void *data; /* The mapping of the trace */
+	size_t len; /* Its length */
+};
+/* Where to read the delivery trace of each direction from, or NULL,
+ * indexed by direction - 1 */
+const char *trace_paths[2];
+const char *rules_path = NULL; /* File giving parameters to some packets */
+const char *histogram_path = NULL; /* Measured delays, for -D empirical */
+/* The parameters given to each direction with -A, as key=value lists
+ * applied to those of the link, or NULL */
+const char *dir_lists[2];
+const char *record_path = NULL; /* Where to record the decisions */
+const char *replay_path = NULL; /* Where to replay the decisions from */
+/* Send the delayed packets right away, with their departure date, for the
+ * qdisc of the device to pace them (SO_TXTIME) */
+int use_txtime = 0;
+int busy_poll = 0; /* Spin on the socket and the queue instead of sleeping */
+/* How long to spin without any packet before sleeping (us), 0 to never
+ * sleep */
+unsigned long busy_window = 0;
+int sock_busy_poll = 0; /* SO_BUSY_POLL on the socket (us), 0 if unset */
+uint64_t spin_us = 0, sleep_us = 0; /* Where the busy-poll loop spent time */
+size_t busy_sleeps = 0; /* How many times the busy-poll loop slept */
+#ifdef CLOCK_MONOTONIC_RAW
+clockid_t clock_id = CLOCK_MONOTONIC; /* The clock of the link */
+#endif
+const char *pin_cpus = NULL; /* The CPUs to run on, or NULL */
+int fifo_priority = 0; /* SCHED_FIFO priority, 0 to keep the default policy */
+int lock_memory = 0; /* Preallocate the packets and lock the memory */
+/* Offline mode statistics */
+size_t pcap_read_pkts = 0, pcap_skipped_pkts = 0, pcap_written_pkts = 0;
+
+struct link { /* A simulated link, and the socket relaying its traffic */
+	int port; /* The UDP port on which it listens */
+	const char *forward_host; /* Where its traffic is forwarded */
+	int forward_port;
+	struct linksim_params params; /* Its parameters */
+	/* Its parameters before the configuration file */
+	struct linksim_params base_params;
+	int sfd; /* Its socket */
+	linksim_t *sim; /* The simulation of the link */
+	struct peer dest_peer, src_peer; /* The 2 parties */
+	int has_source_addr; /* Have we seen the other party yet */
+	/* The datagrams sent right away (with their departure date under
+	 * SO_TXTIME), and those sent after a delay */
+	struct tx_batch tx_now, tx_delayed;
+	/* The backlogs for each direction, indexed by direction - 1 */
+	struct tx_backlog backlogs[2];
+	/* The delivery state of each direction, indexed by direction - 1 */
+	struct tx_state tx_states[2];
+	/* Offline mode: the headers for each direction, indexed by
+	 * direction - 1 */
+	struct frame_template templates[2];
+	/* The delivery traces for each direction, indexed by direction - 1 */
+	struct trace_file traces[2];
+	struct linksim_rule *rules; /* The rules loaded from rules_path */
+	size_t nrules;
+	declog_t *record_log, *replay_log; /* The decision logs */
+	size_t truncated_pkts; /* How many datagrams have been truncated */
+	/* UDP GRO/GSO statistics */
+	size_t gro_pkts, gro_segs, gso_pkts, gso_segs;
+	/* How many packets have been dated by the kernel, and how long they
+	 * waited before we read them, in total */
+	size_t rx_stamped;
+	uint64_t rx_wait_us;
+	/* Datagrams dropped by the kernel as the socket receive queue was
+	 * full, as told by SO_RXQ_OVFL */
+	uint32_t kernel_drops;
+	size_t rx_dgrams; /* Datagrams received on sfd */
+};
+/* The links served by the process, sharing its loop, clock and buffers:
+ * the one of the command line, or those of links_path */
+struct link *links = NULL;
+size_t nlinks = 0;
+/* The links read from links_path, or NULL */
+struct config_link *link_defs = NULL;
+/* The packets delayed by all the links, preallocated with -L */
+linksim_pool_t *pkt_pool = NULL;
 
 /* Get the human-readable representation of an IPv6 */
 static inline const char *sockaddr6_to_human(const struct in6_addr *a)
 {
 	static char b[INET6_ADDRSTRLEN];
 	/* Can safely ignore return value as we control all parameters */
-	inet_ntop(AF_INET6, a, b, sizeof(*a));
+	inet_ntop(AF_INET6, a, b, sizeof(b));
 	return b;
 }
 
-/* @return: left > right */
-static inline int timeval_cmp(const struct timeval *left,
-							const struct timeval *right)
-{
-	return left->tv_sec == right->tv_sec ?
-		left->tv_usec > right->tv_usec :
-		left->tv_sec > right->tv_sec;
-}
-
 /* @return: c = a - b */
 static void timeval_diff(const struct timeval *a,
 					const struct timeval *b,
@@ -125,133 +258,638 @@ static void timeval_diff(const struct timeval *a,
 	}
 }
 
-/* Log an action on a processed packet */
-#define LOG_PKT_FMT(buf, fmt, ...) \
-	fprintf(stderr,"[%s %3hhu] " fmt, ((uint8_t)buf[0] & 0xC0) == 0x00 ? "FEC" : "SEQ" , (((uint8_t)buf[0] & 0xC0) <= 0x40) ? buf[3] : buf[1], ##__VA_ARGS__)
-#define LOG_PKT(buf, msg) LOG_PKT_FMT(buf, msg "\n")
+/* Offline mode: append a packet to the resulting capture, reusing the
+ * headers of the first frame seen in the same direction */
+static int write_pcap(struct link *l, const char *buf, int len,
+		int direction, const struct timeval *ts)
+{
+	uint8_t *frame = (uint8_t*)pkt_buf;
+	const struct frame_template *t = &l->templates[direction - 1];
+	linksim_log(l->sim, buf, len, "Sent packet (%s).\n",
+			linksim_direction_str(direction));
+	memcpy(frame, t->hdr, t->udp.hdr_len);
+	memcpy(frame + t->udp.hdr_len, buf, len);
+	pcap_udp_fixup(frame, &t->udp, len);
+	if (pcap_write(pcap_out, ts, frame, t->udp.hdr_len + len))
+		return EXIT_FAILURE;
+	++pcap_written_pkts;
+	return EXIT_SUCCESS;
+}
 
-/* Send a packet to the host we're proxying */
-static int write_out(const char *buf, int len, int direction)
+/* Get the host receiving the packets sent in a direction of a link */
+static const struct peer *peer_of(const struct link *l, int direction)
 {
-	struct sockaddr_in6 *addr;
 	switch (direction) {
-		case LINK_FORWARD: addr = &dest_addr;
-						   break;
-		case LINK_REVERSE: addr = &src_addr;
-						   break;
-		default: addr = NULL;
-				 break;
+		case LINK_FORWARD: return &l->dest_peer;
+		case LINK_REVERSE: return &l->src_peer;
+		default: return NULL;
+	};
+}
+
+/* Map an IPv4 address in IPv6, as the dual-stack socket reports IPv4 hosts */
+static void map_ipv4(const struct sockaddr_in *in, struct sockaddr_in6 *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->sin6_family = AF_INET6;
+	out->sin6_port = in->sin_port;
+	out->sin6_addr.s6_addr[10] = out->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&out->sin6_addr.s6_addr[12], &in->sin_addr, 4);
+}
+
+/* Set the address of a party, in IPv6 or mapped IPv4 */
+static void set_peer(struct peer *p, const struct sockaddr_in6 *addr)
+{
+	p->addr = *addr;
+	if (sock_family == AF_INET6) {
+		p->wire.in6 = *addr;
+		p->wire_len = sizeof(p->wire.in6);
+		return;
+	}
+	/* An IPv4 socket only reaches IPv4 hosts, hence mapped addresses */
+	memset(&p->wire.in, 0, sizeof(p->wire.in));
+	p->wire.in.sin_family = AF_INET;
+	p->wire.in.sin_port = addr->sin6_port;
+	memcpy(&p->wire.in.sin_addr, &addr->sin6_addr.s6_addr[12], 4);
+	p->wire_len = sizeof(p->wire.in);
+}
+
+#ifdef HAVE_TXTIME
+/* Attach the departure date of the datagram(s) to a message, in the
+ * control message cm */
+static void add_txtime(struct cmsghdr *cm, const struct timeval *ts)
+{
+	uint64_t ns = (uint64_t)ts->tv_sec * 1000000000 +
+		(uint64_t)ts->tv_usec * 1000;
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_TXTIME;
+	cm->cmsg_len = CMSG_LEN(sizeof(ns));
+	memcpy(CMSG_DATA(cm), &ns, sizeof(ns));
+}
+
+/* Send a datagram that must leave at ts */
+static int send_txtime(int fd, const char *buf, int len,
+		const struct peer *to, const struct timeval *ts)
+{
+	union { /* Properly aligned room for the departure date */
+		char buf[CMSG_SPACE(sizeof(uint64_t))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = (char*)buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_name = (void*)&to->wire, .msg_namelen = to->wire_len,
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf),
 	};
-	LOG_PKT_FMT(buf, "Sent packet (%s).\n", get_link_direction(direction));
-	return sendto(sfd, buf, len, 0, (struct sockaddr*)addr,
-			sizeof(*addr)) == len ? EXIT_SUCCESS : EXIT_FAILURE;
-}
-
-/* Deliver all queued packets whose timestamps have expired */
-static int deliver_delayed_pkt()
-{
-	struct pkt_slot *p = (struct pkt_slot*)minq_peek(pkt_queue);
-	/* We have a packet and its timestamp is < current time */
-	while (p && timeval_cmp(&last_clock, &p->ts)) {
-		/* Send it */
-		if (write_out(p->buf, p->size, p->direction)) {
-			/* We can try again later for these errors
-			 * (send bunf is full, or ...) */
-			if (errno == EWOULDBLOCK || errno == EINTR || errno == EAGAIN)
-				return EXIT_SUCCESS;
-			/* Otherwise propagate error */
-			perror("Failed to write all delayed bytes");
+	add_txtime(CMSG_FIRSTHDR(&msg), ts);
+	return sendmsg(fd, &msg, 0) == len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
+/* Send a packet to the host we're proxying
+ * @ts: The date at which the packet is sent, used in offline mode */
+static int write_out(struct link *l, const char *buf, int len,
+		int direction, const struct timeval *ts)
+{
+	const struct peer *to = peer_of(l, direction);
+	if (pcap_out)
+		return write_pcap(l, buf, len, direction, ts);
+	linksim_log(l->sim, buf, len, "Sent packet (%s).\n",
+			linksim_direction_str(direction));
+#ifdef HAVE_TXTIME
+	if (use_txtime)
+		return send_txtime(l->sfd, buf, len, to, ts);
+#endif
+	return sendto(l->sfd, buf, len, 0, (const struct sockaddr*)&to->wire,
+			to->wire_len) == len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* @return: whether a datagram can be sent along with those in the batch */
+static inline int tx_batch_fits(const struct tx_batch *b, size_t len,
+		int direction, const struct timeval *ts)
+{
+	return !b->n || (use_gso && b->n < MAX_GSO_SEGS &&
+			direction == b->direction && len <= b->seg_len &&
+			/* They all leave at the same date */
+			(!use_txtime || (ts->tv_sec == b->ts.tv_sec &&
+							 ts->tv_usec == b->ts.tv_usec)) &&
+			/* Only the last datagram can be shorter than the others */
+			b->len == b->n * b->seg_len &&
+			b->len + len <= MAX_UDP_PAYLOAD);
+}
+
+/* Add a datagram to the batch, which must fit. buf must stay valid until
+ * the batch is flushed. */
+static inline void tx_batch_add(struct tx_batch *b, const char *buf,
+		size_t len, int direction, const struct timeval *ts)
+{
+	if (!b->n) {
+		b->direction = direction;
+		b->ts = *ts;
+		b->seg_len = len;
+		b->len = 0;
+	}
+	b->iov[b->n].iov_base = (char*)buf;
+	b->iov[b->n].iov_len = len;
+	b->len += len;
+	++b->n;
+}
+
+#ifdef HAVE_UDP_GSO
+/* Send all the datagrams of the batch with a single UDP GSO send */
+static int send_gso(struct link *l, const struct tx_batch *b)
+{
+	union { /* Properly aligned room for the segment size and the date */
+		char buf[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+		struct cmsghdr align;
+	} control;
+	const struct peer *to = peer_of(l, b->direction);
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	size_t i;
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_name = (void*)&to->wire;
+	msg.msg_namelen = to->wire_len;
+	msg.msg_iov = (struct iovec*)b->iov;
+	msg.msg_iovlen = b->n;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = IPPROTO_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t*)CMSG_DATA(cm) = b->seg_len;
+#ifdef HAVE_TXTIME
+	if (use_txtime)
+		add_txtime(CMSG_NXTHDR(&msg, cm), &b->ts);
+	else
+#endif
+		msg.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+	if (sendmsg(l->sfd, &msg, 0) != (ssize_t)b->len)
+		return EXIT_FAILURE;
+	for (i = 0; i < b->n; ++i)
+		linksim_log(l->sim, b->iov[i].iov_base, b->iov[i].iov_len,
+				"Sent packet (%s).\n", linksim_direction_str(b->direction));
+	++l->gso_pkts;
+	l->gso_segs += b->n;
+	return EXIT_SUCCESS;
+}
+#endif
+
+/* Send the batched datagrams, at once if there are several of them
+ * @return: non-zero value on error, with errno set. The batch then only
+ *          holds the datagrams that have not been sent.
+ */
+static int tx_batch_flush(struct link *l, struct tx_batch *b)
+{
+	size_t i;
+#ifdef HAVE_UDP_GSO
+	if (b->n > 1) {
+		if (!send_gso(l, b)) {
+			b->n = 0;
+			return EXIT_SUCCESS;
+		}
+		/* Unless the device cannot segment them, nothing was sent */
+		if (errno != EIO)
+			return EXIT_FAILURE;
+		fprintf(stderr, "!! UDP GSO is not supported by the device, "
+				"disabling it\n");
+		use_gso = 0;
+	}
+#endif
+	for (i = 0; i < b->n; ++i) {
+		if (write_out(l, b->iov[i].iov_base, b->iov[i].iov_len,
+					b->direction, &b->ts)) {
+			/* Keep the remaining datagrams */
+			memmove(b->iov, b->iov + i, (b->n - i) * sizeof(*b->iov));
+			b->n -= i;
 			return EXIT_FAILURE;
 		}
-		minq_pop(pkt_queue);
-		free(p);
-		p = (struct pkt_slot*)minq_peek(pkt_queue);
 	}
+	b->n = 0;
 	return EXIT_SUCCESS;
 }
 
-/* @return: 1 iff a != b, else 0 */
+/* @return: 1 iff a != b, else 0. IPv4 addresses are mapped in IPv6, so
+ *          that a single comparison, without branches, covers both */
 static inline int sockaddr_cmp(const struct sockaddr_in6 *a,
 						const struct sockaddr_in6 *b)
 {
-	return memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) ||
-		a->sin6_port != b->sin6_port;
+	uint64_t x[2], y[2];
+	memcpy(x, &a->sin6_addr, sizeof(x));
+	memcpy(y, &b->sin6_addr, sizeof(y));
+	return ((x[0] ^ y[0]) | (x[1] ^ y[1]) |
+			(uint64_t)(a->sin6_port ^ b->sin6_port)) != 0;
 }
 
-/* Simulate the effect of a lossy link on a received packet */
-static inline int simulate_link(char *buf, int len, int direction)
+/* @return: whether a send failed because the socket is full, or was
+ *          interrupted, hence can be tried again later */
+static inline int send_can_retry(int err)
 {
-	/* Do we drop it? */
-	if (loss_rate && RAND_PERCENT < loss_rate) {
-		LOG_PKT(buf, "Dropping packet");
-		return EXIT_SUCCESS;
+	return err == EWOULDBLOCK || err == EAGAIN || err == EINTR;
+}
+
+/* Keep a copy of a datagram until the socket can send it, or drop it if
+ * the backlog of its direction is full
+ * @ts: When the datagram leaves */
+static void backlog_push(struct link *l, const char *buf, size_t len,
+		int direction, const struct timeval *ts)
+{
+	struct tx_backlog *b = &l->backlogs[direction - 1];
+	size_t i;
+	if (b->count == backlog_len) {
+		linksim_log(l->sim, buf, len, "Dropped packet (%s), the send backlog "
+				"is full.\n", linksim_direction_str(direction));
+		++b->dropped;
+		return;
 	}
-	/* Do we cut it after the header? (only if packet is elligible) */
-	if (cut_rate && RAND_PERCENT < cut_rate && len > MIN_PKT_PDATA_LEN &&  ((uint8_t) buf[0])>>6 == 1) {
-		LOG_PKT(buf, "Truncating packet");
-		len = MIN_PKT_PDATA_LEN;
-		/* ... and don't forget to mark it as truncated */
-		buf[0] |= 0x20;
-	/* or do we corrupt it? */
-	} else if (err_rate && RAND_PERCENT < err_rate) {
-		int idx = rand() % len;
-		LOG_PKT_FMT(buf, "Corrupting packet: inverted byte #%d\n", idx);
-		buf[idx] = ~buf[idx];
-	}
-	/* Do we want to simulate delay? */
-	if (delay) {
-		/* Random delay to add is capped to 10s */
-		unsigned int applied_delay;
-		if (jitter) {
-			if (jitter > delay) {
-				applied_delay = rand() % (delay + jitter);
-			} else {
-				applied_delay = (delay + rand() % (2 * jitter)) - jitter;
+	i = (b->head + b->count) % backlog_len;
+	memcpy(b->slots + i * max_pkt_len, buf, len);
+	b->lens[i] = len;
+	b->dates[i] = *ts;
+	++b->queued;
+	if (++b->count > b->peak)
+		b->peak = b->count;
+}
+
+/* @return: whether some datagrams wait for the socket to be writable */
+static inline int backlogged(const struct link *l)
+{
+	return l->backlogs[0].count || l->backlogs[1].count;
+}
+
+/* @return: whether some datagrams, either forwarded right away or delayed,
+ *          wait for the socket to be writable */
+static inline int tx_waiting(const struct link *l)
+{
+	return backlogged(l) || l->tx_states[0].blocked ||
+		l->tx_states[1].blocked;
+}
+
+/* Send the backlogged datagrams, in order, until the socket is full again,
+ * and let the delayed packets be sent again
+ * @return: non-zero value on error
+ */
+static int resume_tx(struct link *l)
+{
+	struct tx_backlog *b;
+	int direction;
+	for (direction = LINK_FORWARD; direction <= LINK_REVERSE; ++direction) {
+		l->tx_states[direction - 1].blocked = 0;
+		for (b = &l->backlogs[direction - 1]; b->count; --b->count) {
+			if (write_out(l, b->slots + b->head * max_pkt_len, b->lens[b->head],
+						direction, &b->dates[b->head])) {
+				if (send_can_retry(errno))
+					break;
+				perror("Failed to write all bytes");
+				return EXIT_FAILURE;
 			}
-		} else {
-			applied_delay = delay;
+			b->head = (b->head + 1) % backlog_len;
 		}
-		applied_delay %= 10000;
-		LOG_PKT_FMT(buf, "Delayed packet by %u ms\n", applied_delay);
-		/* Create a slot for the packet queue */
-		struct pkt_slot *slot;
-		if (!(slot = malloc(sizeof(*slot)))) {
-			fprintf(stderr,
-					"Failed to allocate memory for a delayed packet!\n");
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Allocate the backlogs of the live mode
+ * @return: non-zero value on error
+ */
+static int alloc_backlogs(struct link *l)
+{
+	struct tx_backlog *b;
+	int i;
+	if (backlog_len > SIZE_MAX / max_pkt_len ||
+			backlog_len > SIZE_MAX / sizeof(*b->dates)) {
+		errno = ENOMEM;
+		perror("Cannot allocate the send backlogs");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < 2; ++i) {
+		b = &l->backlogs[i];
+		if (!(b->slots = malloc(backlog_len * max_pkt_len)) ||
+				!(b->lens = malloc(backlog_len * sizeof(*b->lens))) ||
+				!(b->dates = malloc(backlog_len * sizeof(*b->dates)))) {
+			perror("Cannot allocate the send backlogs");
 			return EXIT_FAILURE;
 		}
-		slot->direction = direction;
-		/* Copy the packet in the slot */
-		memcpy(slot->buf, buf, len);
-		slot->size = len;
-		/* Register expiration date: current date + delay */
-		slot->ts.tv_sec = last_clock.tv_sec + applied_delay / 1000;
-		/* delay is in ms not us! */
-		slot->ts.tv_usec = last_clock.tv_usec + (applied_delay % 1000) * 1000;
-		/* Enqueue the new slot */
-		if (minq_push(pkt_queue, slot)) {
+	}
+	return EXIT_SUCCESS;
+}
+
+static void free_backlogs(struct link *l)
+{
+	int i;
+	for (i = 0; i < 2; ++i) {
+		free(l->backlogs[i].slots);
+		free(l->backlogs[i].lens);
+		free(l->backlogs[i].dates);
+	}
+}
+
+/* Forward the datagrams that were not delayed by the link. Those that the
+ * socket cannot take yet are backlogged. */
+static int flush_forwarded(struct link *l)
+{
+	struct tx_batch *b = &l->tx_now;
+	size_t i;
+	if (!tx_batch_flush(l, b))
+		return EXIT_SUCCESS;
+	if (!send_can_retry(errno)) {
+		perror("Failed to write all bytes");
+		b->n = 0;
+		return EXIT_FAILURE;
+	}
+	/* The batch kept the datagrams that were not sent */
+	for (i = 0; i < b->n; ++i)
+		backlog_push(l, b->iov[i].iov_base, b->iov[i].iov_len,
+				b->direction, &b->ts);
+	b->n = 0;
+	return EXIT_SUCCESS;
+}
+
+/* Account for the lateness of a delayed packet that has just been sent */
+static inline void count_lateness(struct link *l,
+		const struct linksim_pkt *p)
+{
+	struct tx_state *st = &l->tx_states[p->direction - 1];
+	int64_t late;
+	uint64_t us;
+	++st->sent;
+	/* Signed, as the packet may have been sent on time */
+	late = (int64_t)(last_clock.tv_sec - p->ts.tv_sec) * 1000000 +
+		(last_clock.tv_usec - p->ts.tv_usec);
+	if (late <= 0)
+		return;
+	us = late;
+	st->late_us += us;
+	if (us > st->late_max_us)
+		st->late_max_us = us;
+	if (us > 1000)
+		++st->late;
+}
+
+/* Send the delayed packets whose date has passed, in a direction
+ * @direction: LINK_FORWARD or LINK_REVERSE, or LINK_BOTH_WAYS to send
+ *             those of both directions by date
+ */
+static int deliver_due(struct link *l, int direction,
+		const struct timeval *now)
+{
+	struct tx_batch *b = &l->tx_delayed;
+	struct linksim_pkt **due;
+	size_t n, i, j;
+	int err;
+	/* Extract all packets whose timestamp is < current time */
+	n = direction == LINK_BOTH_WAYS ? linksim_poll(l->sim, now, &due) :
+		linksim_poll_direction(l->sim, direction, now, &due);
+	for (i = 0; i <= n; ++i) {
+		/* Send the batch once the next packet cannot join it */
+		if (b->n && (i == n || !tx_batch_fits(b, due[i]->size,
+						due[i]->direction, &due[i]->ts))) {
+			size_t first = i - b->n, unsent;
+			if (tx_batch_flush(l, b)) {
+				err = errno;
+				/* The batch kept the packets that were not sent */
+				unsent = i - b->n;
+				b->n = 0;
+				for (j = first; j < unsent; ++j) {
+					if (!pcap_out)
+						count_lateness(l, due[j]);
+					linksim_pkt_free(l->sim, due[j]);
+				}
+				/* Put back the packets we could not send */
+				if (linksim_requeue(l->sim, due + unsent, n - unsent)) {
+					perror("Failed to re-enqueue delayed packets");
+					return EXIT_FAILURE;
+				}
+				/* We can try again later for these errors
+				 * (send bunf is full, or ...), once the socket is
+				 * writable */
+				if (send_can_retry(err)) {
+					if (direction != LINK_BOTH_WAYS)
+						l->tx_states[direction - 1].blocked = 1;
+					return EXIT_SUCCESS;
+				}
+				/* Otherwise propagate error */
+				errno = err;
+				perror("Failed to write all delayed bytes");
+				return EXIT_FAILURE;
+			}
+			for (j = first; j < i; ++j) {
+				if (!pcap_out)
+					count_lateness(l, due[j]);
+				linksim_pkt_free(l->sim, due[j]);
+			}
+		}
+		if (i < n)
+			tx_batch_add(b, due[i]->buf, due[i]->size, due[i]->direction,
+					&due[i]->ts);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Send the delayed packets whose date has passed. Each direction is
+ * delivered on its own, so that a direction waiting for the socket does
+ * not hold back the other one. With SO_TXTIME, the packets are never
+ * queued, see simulate_link(). */
+static int deliver_delayed_pkt(struct link *l)
+{
+	const struct timeval *now = &last_clock;
+	int direction;
+	/* The resulting capture is written by date, and never blocks */
+	if (pcap_out)
+		return deliver_due(l, LINK_BOTH_WAYS, now);
+	for (direction = LINK_FORWARD; direction <= LINK_REVERSE; ++direction)
+		if (!l->tx_states[direction - 1].blocked &&
+				deliver_due(l, direction, now))
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+/* Simulate the effect of a lossy link on a received packet. With
+ * SO_TXTIME, a delayed packet is not queued but sent right away, along with
+ * its departure date, for the qdisc to hold it until then.
+ * @at: When the packet has arrived */
+static inline int simulate_link(struct link *l, char *buf, int len,
+		int direction, const struct timeval *at)
+{
+	struct timeval date = last_clock;
+	size_t size = len;
+	int rval = use_txtime ?
+		linksim_push_dated(l->sim, buf, &size, direction, at, &date) :
+		linksim_push(l->sim, buf, &size, direction, at);
+	switch (rval) {
+		case LINKSIM_FORWARD:
+		case LINKSIM_DATED:
+			/* Forward it to the host we're proxying, possibly along with
+			 * the previous datagrams of a GRO packet */
+			if (!tx_batch_fits(&l->tx_now, size, direction, &date) &&
+					flush_forwarded(l))
+				return EXIT_FAILURE;
+			/* Do not overtake the datagrams waiting for the socket */
+			if (l->backlogs[direction - 1].count)
+				backlog_push(l, buf, size, direction, &date);
+			else
+				tx_batch_add(&l->tx_now, buf, size, direction, &date);
+			return EXIT_SUCCESS;
+		case LINKSIM_ERROR:
 			perror("Failed to enqueue a packet!");
 			return EXIT_FAILURE;
-		}
+		default:
+			return EXIT_SUCCESS;
+	}
+}
+
+/* Account for a datagram larger than max_pkt_len */
+static void count_truncated(struct link *l)
+{
+	if (!l->truncated_pkts++)
+		fprintf(stderr, "!! Truncating datagrams larger than %zu bytes, "
+				"see -m\n", max_pkt_len);
+}
+
+/* Simulate the link on each datagram of a received packet, which is a
+ * single datagram unless the kernel coalesced several of them (UDP GRO)
+ * @seg_len: The size of the coalesced datagrams, 0 if there is a single one
+ * @at: When the packet has arrived
+ */
+static int simulate_link_segments(struct link *l, char *buf, size_t len,
+		size_t seg_len, int direction, const struct timeval *at)
+{
+	size_t off, n;
+	if (seg_len) {
+		++l->gro_pkts;
+		l->gro_segs += (len + seg_len - 1) / seg_len;
 	} else {
-		/* Forward it to the host we're proxying */
-		if (write_out(buf, len, direction)) {
-			perror("Failed to write all bytes");
-			return EXIT_FAILURE;
+		seg_len = len;
+	}
+	for (off = 0; off < len; off += seg_len) {
+		n = len - off < seg_len ? len - off : seg_len;
+		/* Check packet consistency */
+		if (n < proto->min_len) {
+			fprintf(stderr,"Received malformed data, dropping. "
+					"(len < %zu)\n", proto->min_len);
+			continue;
 		}
+		/* The datagrams of a GRO packet have not been truncated yet */
+		if (n > max_pkt_len) {
+			count_truncated(l);
+			n = max_pkt_len;
+		}
+		if (simulate_link(l, buf + off, n, direction, at))
+			return EXIT_FAILURE;
 	}
+	return flush_forwarded(l);
+}
+
+/* @return: the size of the datagrams coalesced in a received packet, 0 if
+ *          it is a single datagram */
+static size_t gro_seg_len(struct msghdr *msg)
+{
+#ifdef HAVE_UDP_GSO
+	struct cmsghdr *cm;
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+		if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+			return *(int*)CMSG_DATA(cm);
+#else
+	(void)msg;
+#endif
+	return 0;
+}
+
+/* Date a received packet with its arrival in the kernel, rather than when
+ * the loop woke up, which may be later by a whole batch of packets.
+ * The kernel stamps it with the wall clock, so its age is subtracted from
+ * the current date of the link clock.
+ * @return: EXIT_SUCCESS if @at has been set, EXIT_FAILURE if the packet
+ *          carries no usable arrival date */
+static int arrival_date(struct link *l, struct msghdr *msg,
+		struct timeval *at)
+{
+#ifdef HAVE_RX_TIMESTAMPS
+	struct cmsghdr *cm;
+	struct timespec stamp, wall, now;
+	int64_t age, date;
+#ifdef CLOCK_MONOTONIC_RAW
+	clockid_t link_clock = clock_id;
+#else
+	clockid_t link_clock = CLOCK_MONOTONIC;
+#endif
+	if (!rx_timestamps)
+		return EXIT_FAILURE;
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+			break;
+	if (!cm || clock_gettime(CLOCK_REALTIME, &wall) ||
+			clock_gettime(link_clock, &now))
+		return EXIT_FAILURE;
+	memcpy(&stamp, CMSG_DATA(cm), sizeof(stamp));
+	age = (int64_t)(wall.tv_sec - stamp.tv_sec) * 1000000000 +
+		wall.tv_nsec - stamp.tv_nsec;
+	/* The wall clock has been stepped back since the arrival */
+	if (age < 0)
+		return EXIT_FAILURE;
+	date = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec - age;
+	at->tv_sec = date / 1000000000;
+	at->tv_usec = date % 1000000000 / 1000;
+	++l->rx_stamped;
+	l->rx_wait_us += age / 1000;
 	return EXIT_SUCCESS;
+#else
+	(void)l;
+	(void)msg;
+	(void)at;
+	return EXIT_FAILURE;
+#endif
 }
 
-/* sfd has been marked for reading, handle the read and process the packet */
-static int process_incoming_pkt()
+/* Keep track of the datagrams the kernel dropped before we could read
+ * them, which the socket tells along with the next one it delivers */
+static void count_kernel_drops(struct link *l, struct msghdr *msg)
 {
-	struct sockaddr_in6 from; /* Whois the one sending us data? */
-	socklen_t len_from = sizeof(from);
-	char buf[MAX_PKT_LEN]; /* Max allowed packet size for the protocol */
+#ifdef SO_RXQ_OVFL
+	struct cmsghdr *cm;
+	uint32_t drops;
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+			/* The counter covers the whole life of the socket */
+			if (drops != l->kernel_drops && !l->kernel_drops)
+				fprintf(stderr, "!! The receive queue of port %d "
+						"overflowed, the kernel drops datagrams, see -B\n",
+						l->port);
+			l->kernel_drops = drops;
+		}
+#else
+	(void)l;
+	(void)msg;
+#endif
+}
+
+/* The socket of a link has been marked for reading, handle the read and
+ * process the packet */
+static int process_incoming_pkt(struct link *l)
+{
+	union { /* Whois the one sending us data? */
+		struct sockaddr_in6 in6;
+		struct sockaddr_in in;
+	} from_any;
+	struct sockaddr_in6 from;
+	char *buf = pkt_buf;
+	struct iovec iov = { .iov_base = buf, .iov_len = rx_len };
+	union { /* Properly aligned room for the GRO segment size, the
+			 * arrival date and the drop counter */
+		char buf[CMSG_SPACE(sizeof(int)) +
+			CMSG_SPACE(sizeof(struct timespec)) +
+			CMSG_SPACE(sizeof(uint32_t))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_name = &from_any, .msg_namelen = sizeof(from_any),
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+	};
 	int len; /* Actual received packet size */
-	if ((len = recvfrom(sfd, buf, MAX_PKT_LEN, 0,
-					(struct sockaddr *)&from, &len_from)) < 0) {
+	if ((len = recvmsg(l->sfd, &msg, 0)) < 0) {
 		/* Ignore if we have been interrupted by a signal,
 		 * or if select marked sfd as ready for reading
 		 * without any no data available. */
@@ -261,25 +899,36 @@ static int process_incoming_pkt()
 		perror("recv failed");
 		return EXIT_FAILURE;
 	}
+	++l->rx_dgrams;
+	/* Compare the addresses of both families in the same form */
+	if (sock_family == AF_INET6)
+		from = from_any.in6;
+	else
+		map_ipv4(&from_any.in, &from);
+	count_kernel_drops(l, &msg);
+	/* The rest of the datagram did not fit in buf and has been lost */
+	if (msg.msg_flags & MSG_TRUNC)
+		count_truncated(l);
 	/* Check packet consistency */
-	if (len < MIN_PKT_LEN) {
+	if ((size_t)len < proto->min_len) {
 		fprintf(stderr,"Received malformed data, dropping. "
-				"(len < %d)\n", MIN_PKT_LEN);
+				"(len < %zu)\n", proto->min_len);
 		return EXIT_SUCCESS;
 	}
 	/* We need to track who is sending us data, so that we can send him the
 	 * reverse traffic coming from the host we're proxying
 	 */
-	if (!has_source_addr) {
-		memcpy(&src_addr, &from, sizeof(src_addr));
-		fprintf(stderr, "@@ Remote host is %s [%d]\n",
-				sockaddr6_to_human(&from.sin6_addr), ntohs(from.sin6_port));
-		has_source_addr = 1; /* We're logically connected to that guy */
+	if (!l->has_source_addr) {
+		set_peer(&l->src_peer, &from);
+		fprintf(stderr, "@@ Remote host is %s [%d], on port %d\n",
+				sockaddr6_to_human(&from.sin6_addr), ntohs(from.sin6_port),
+				l->port);
+		l->has_source_addr = 1; /* We're logically connected to that guy */
 	}
 	int direction = 0;
-	if (!sockaddr_cmp(&from, &dest_addr))
+	if (!sockaddr_cmp(&from, &l->dest_peer.addr))
 		direction = LINK_REVERSE;
-	if (!sockaddr_cmp(&from, &src_addr))
+	if (!sockaddr_cmp(&from, &l->src_peer.addr))
 		direction = LINK_FORWARD;
 	if (!direction) {
 		/* We do not know the guy that sent us this data, ignore him */
@@ -288,18 +937,60 @@ static int process_incoming_pkt()
 			len, sockaddr6_to_human(&from.sin6_addr), ntohs(from.sin6_port));
 		return EXIT_SUCCESS;
 	}
-	/* Simply relay packets from the host we're proxying */
-	if (!SAME_DIRECTION(direction, link_direction)) {
-		if (write_out(buf, len, direction)) {
-			perror("Failed to relay a message without altering it.");
-			return EXIT_FAILURE;
-		}
-		return EXIT_SUCCESS;
-	}
 	/* We have valid data, simulate the behavior of a lossy link
 	 * before delivery
 	 */
-	return simulate_link(buf, len, direction);
+	struct timeval at;
+	if (arrival_date(l, &msg, &at))
+		at = last_clock;
+	return simulate_link_segments(l, buf, len, gro_seg_len(&msg), direction,
+			&at);
+}
+
+/* Offline mode: process one captured frame, as if it had been received */
+static int process_captured_pkt(struct link *l, const struct pcap_rec *rec,
+		uint8_t *frame)
+{
+	struct pcap_udp udp;
+	struct frame_template *t;
+	char *buf;
+	int len, direction;
+	/* Ignore everything that is not a complete UDP datagram */
+	if (pcap_udp_parse(pcap_linktype(pcap_in), frame, rec->caplen, &udp)) {
+		++pcap_skipped_pkts;
+		return EXIT_SUCCESS;
+	}
+	/* The traffic towards forward_port is the forward path */
+	if (udp.dport == l->forward_port) {
+		direction = LINK_FORWARD;
+	} else if (udp.sport == l->forward_port) {
+		direction = LINK_REVERSE;
+	} else {
+		++pcap_skipped_pkts;
+		return EXIT_SUCCESS;
+	}
+	buf = (char*)frame + udp.hdr_len;
+	/* Truncate as recvmsg() would have done */
+	len = udp.len;
+	if (udp.len > max_pkt_len) {
+		count_truncated(l);
+		len = max_pkt_len;
+	}
+	/* Check packet consistency */
+	if ((size_t)len < proto->min_len) {
+		fprintf(stderr,"Received malformed data, dropping. "
+				"(len < %zu)\n", proto->min_len);
+		return EXIT_SUCCESS;
+	}
+	t = &l->templates[direction - 1];
+	if (!t->valid) {
+		memcpy(t->hdr, frame, udp.hdr_len);
+		t->udp = udp;
+		t->valid = 1;
+	}
+	if (simulate_link(l, buf, len, direction, &last_clock))
+		return EXIT_FAILURE;
+	return flush_forwarded(l);
 }
 
 /* Update last_lock to the current time */
@@ -312,7 +1003,11 @@ static int update_time()
 	}
 #else /* gettimeofday is deprecated */
 	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+	if (clock_gettime(clock_id, &ts)) {
+#else
 	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+#endif
 		perror("Cannot internal clock");
 		return EXIT_FAILURE;
 	}
@@ -322,19 +1017,47 @@ static int update_time()
 	return EXIT_SUCCESS;
 }
 
-/* If a packet is queue, return how long until it should be delivered,
- * otherwise return NULL
+/* @return: whether a is before b */
+static inline int timeval_before(const struct timeval *a,
+		const struct timeval *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* Get the closest expiration date of the packets queued by a link, in the
+ * directions that are not waiting for the socket to be writable
+ * @return: EXIT_FAILURE if there is none */
+static int next_deadline(const struct link *l, struct timeval *ts)
+{
+	struct timeval rev;
+	int has_fwd = !l->tx_states[0].blocked &&
+		!linksim_next_deadline_direction(l->sim, LINK_FORWARD, ts);
+	int has_rev = !l->tx_states[1].blocked &&
+		!linksim_next_deadline_direction(l->sim, LINK_REVERSE, &rev);
+	if (!has_fwd && !has_rev)
+		return EXIT_FAILURE;
+	if (!has_fwd || (has_rev && timeval_before(&rev, ts)))
+		*ts = rev;
+	return EXIT_SUCCESS;
+}
+
+/* If a packet is queued by any link, return how long until the first one
+ * should be delivered, otherwise return NULL. All the links share this
+ * single timer.
  */
 static struct timeval* get_queue_timeout()
 {
 	static struct timeval timeout;
-	/* No queued packet */
-	if (minq_empty(pkt_queue))
+	struct timeval ts = { LONG_MAX, 0 }, next;
+	size_t i;
+	for (i = 0; i < nlinks; ++i)
+		if (!next_deadline(&links[i], &next) && timeval_before(&next, &ts))
+			ts = next;
+	if (ts.tv_sec == LONG_MAX)
 		return NULL;
-	/* Get closest expiration date for the queued packet */
-	struct timeval *ts = &((struct pkt_slot*)minq_peek(pkt_queue))->ts;
 	/* timeout = expiration_date - current date */
-	timeval_diff(ts, &last_clock, &timeout);
+	timeval_diff(&ts, &last_clock, &timeout);
 	/* If we queued the packet for too long, set a 1ms timeout. We cannot set
 	 * 0 as packet queued for too long can be due to the send buffer
 	 * being full, thus packet not being dequeued.
@@ -346,81 +1069,358 @@ static struct timeval* get_queue_timeout()
 	return &timeout;
 }
 
-/* Loop forever, waiting on packet to process */
+/* Request the proxy loop to terminate */
+static void handle_stop(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+/* Offline mode: replay all captured packets, using their capture date as
+ * the current time, then flush the delayed ones */
+static int replay_loop()
+{
+	struct link *l = links;
+	struct pcap_rec rec;
+	uint8_t *frame;
+	int rval;
+	while (!stop_requested &&
+			(rval = pcap_next(pcap_in, &rec, &frame)) > 0) {
+		++pcap_read_pkts;
+		/* Virtual time: jump to the capture date */
+		last_clock = rec.ts;
+		if (deliver_delayed_pkt(l) || process_captured_pkt(l, &rec, frame))
+			return EXIT_FAILURE;
+	}
+	if (rval < 0) {
+		perror("Cannot read the input capture");
+		return EXIT_FAILURE;
+	}
+	/* Jump to the expiration date of the remaining packets */
+	while (!linksim_next_deadline(l->sim, &last_clock)) {
+		++last_clock.tv_usec;
+		if (deliver_delayed_pkt(l))
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Request the parameters to be reloaded from config_path */
+static void handle_reload(int sig)
+{
+	(void)sig;
+	reload_requested = 1;
+}
+
+/* Describe the impairments of p, on the current line */
+static void describe_params(const struct linksim_params *p)
+{
+	fprintf(stderr, "delay: %u, jitter: %u, delay_dist: %s, err_rate: %u, "
+			"cut_rate: %u, loss_rate: %u, rate: %u", p->delay, p->jitter,
+			linksim_dist_str(p->delay_dist), p->err_rate, p->cut_rate,
+			p->loss_rate, p->rate);
+}
+
+/* Give their own parameters to the directions given some with -A, starting
+ * from those of the link
+ * @return: EXIT_FAILURE if the link refused them, it is then untouched */
+static int set_direction_params(struct link *l,
+		const struct linksim_params *link)
+{
+	struct linksim_params p;
+	int i;
+	for (i = 0; i < 2; ++i) {
+		if (!dir_lists[i])
+			continue;
+		p = *link;
+		/* The lists have been checked when parsing the options */
+		config_set_list(&p, dir_lists[i]);
+		if (linksim_set_direction_params(l->sim, i + 1, &p)) {
+			perror("Cannot set the parameters of a direction");
+			return EXIT_FAILURE;
+		}
+		fprintf(stderr, "@@ %s direction of port %d: ",
+				linksim_direction_str(i + 1), l->port);
+		describe_params(&p);
+		fprintf(stderr, "\n");
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Reload the parameters from config_path, on top of the ones given on the
+ * command line, or in links_path, for each link. The links keep running
+ * with their previous parameters if the file is invalid. */
+static void reload_params()
+{
+	struct linksim_params p;
+	struct link *l;
+	reload_requested = 0;
+	for (l = links; l < links + nlinks; ++l) {
+		p = l->base_params;
+		/* The file is the same for all links */
+		if (config_load(config_path, &p)) {
+			fprintf(stderr, "!! Keeping the previous parameters\n");
+			return;
+		}
+		if (linksim_set_params(l->sim, &p)) {
+			perror("Cannot update the parameters");
+			continue;
+		}
+		l->params = p;
+		fprintf(stderr, "@@ Reloaded %s on port %d: ", config_path, l->port);
+		describe_params(&p);
+		fprintf(stderr, ", link_direction: %s\n",
+				linksim_direction_str(p.link_direction));
+		/* The directions with their own parameters start from the new
+		 * ones */
+		set_direction_params(l, &p);
+	}
+}
+
+/* Wait for incoming data on the sockets of the links, for those that have
+ * a backlog to be writable, or for the timeout to expire
+ * @return: the result of select() */
+static int wait_links(fd_set *rfds, fd_set *wfds, struct timeval *timeout)
+{
+	const struct link *l;
+	int maxfd = -1;
+	FD_ZERO(rfds);
+	FD_ZERO(wfds);
+	for (l = links; l < links + nlinks; ++l) {
+		FD_SET(l->sfd, rfds);
+		/* Wait for the socket to send the backlog, if any */
+		if (tx_waiting(l))
+			FD_SET(l->sfd, wfds);
+		if (l->sfd > maxfd)
+			maxfd = l->sfd;
+	}
+	return select(maxfd + 1, rfds, wfds, NULL, timeout);
+}
+
+/* Loop until asked to stop, waiting on packet to process */
 static int proxy_loop()
 {
-	fd_set rfds;
-	FD_ZERO(&rfds);
+	fd_set rfds, wfds;
+	struct link *l;
 	if (update_time()) return EXIT_FAILURE;
-	while (1) {
-		/* Reset sfd in fdset, as timeout expiration would have removed it. */
-		FD_SET(sfd, &rfds);
+	while (!stop_requested) {
+		/* Parameters are swapped between two packets */
+		if (reload_requested)
+			reload_params();
 		/* Wait for incoming data, or end of a delay on a previously received
 		 * packet */
-		if (select(sfd+1, &rfds, NULL, NULL, get_queue_timeout()) < 0) {
+		if (wait_links(&rfds, &wfds, get_queue_timeout()) < 0) {
 			/* Ignore if interruption is due to a signal */
 			if (errno == EINTR) continue;
-			else {
-				/* Bad things do happen ... */
-				perror("Select failed");
-				break;
-			}
+			/* Bad things do happen ... */
+			perror("Select failed");
+			return EXIT_FAILURE;
 		}
-		if (update_time() || /* Update time cache */
-			deliver_delayed_pkt() || /* Deliver delayed packets */
-			/* Process incoming packets, applying drop rates etc */
-			(FD_ISSET(sfd, &rfds) && process_incoming_pkt()))
-			break;
+		if (update_time()) /* Update time cache */
+			return EXIT_FAILURE;
+		for (l = links; l < links + nlinks; ++l)
+			if ((FD_ISSET(l->sfd, &wfds) && resume_tx(l)) ||
+				deliver_delayed_pkt(l) || /* Deliver delayed packets */
+				/* Process incoming packets, applying drop rates etc */
+				(FD_ISSET(l->sfd, &rfds) && process_incoming_pkt(l)))
+				return EXIT_FAILURE;
 	}
-	/* Reached only on error */
-	return EXIT_FAILURE;
+	return EXIT_SUCCESS;
 }
 
-/* Get a socket,
- * bind to all interfaces on specified port,
- * connect to localhost on forward_port,
+/* @return: tv in us */
+static inline uint64_t timeval_us(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/* Busy-poll variant of proxy_loop(): spin on non-blocking receives and on
+ * the head of the queue, so that packets are neither received nor
+ * delivered late because of a wake-up. With a window, only spin until no
+ * packet was received for that long, then sleep in select() until the
+ * window before the next expiration date, and spin again from there. */
+static int busy_loop()
+{
+	fd_set rfds, wfds;
+	struct timeval *timeout;
+	struct link *l;
+	uint64_t now, start, idle_since, until;
+	size_t seen = 0, received;
+	if (busy_window)
+		fprintf(stderr, "@@ Busy-polling, sleeping after %lu us without "
+				"packets\n", busy_window);
+	else
+		fprintf(stderr, "@@ Busy-polling, never sleeping\n");
+	if (update_time()) return EXIT_FAILURE;
+	start = idle_since = timeval_us(&last_clock);
+	while (!stop_requested) {
+		if (reload_requested)
+			reload_params();
+		if (update_time())
+			return EXIT_FAILURE;
+		received = 0;
+		for (l = links; l < links + nlinks; ++l) {
+			if ((tx_waiting(l) && resume_tx(l)) ||
+					deliver_delayed_pkt(l) || process_incoming_pkt(l))
+				return EXIT_FAILURE;
+			received += l->rx_dgrams;
+		}
+		now = timeval_us(&last_clock);
+		if (received != seen) {
+			seen = received;
+			idle_since = now;
+			continue;
+		}
+		if (!busy_window || now - idle_since < busy_window)
+			continue;
+		/* Idle for long enough, sleep until shortly before the next
+		 * expiration date, or until a packet arrives */
+		if ((timeout = get_queue_timeout())) {
+			until = timeval_us(timeout);
+			if (until <= busy_window)
+				continue;
+			until -= busy_window;
+			timeout->tv_sec = until / 1000000;
+			timeout->tv_usec = until % 1000000;
+		}
+		if (wait_links(&rfds, &wfds, timeout) < 0 && errno != EINTR) {
+			perror("Select failed");
+			return EXIT_FAILURE;
+		}
+		if (update_time())
+			return EXIT_FAILURE;
+		++busy_sleeps;
+		idle_since = timeval_us(&last_clock);
+		sleep_us += idle_since - now;
+	}
+	spin_us = timeval_us(&last_clock) - start - sleep_us;
+	return EXIT_SUCCESS;
+}
+
+/* Size a socket buffer, beyond the limit of the system if we are allowed
+ * to, and report what the kernel granted */
+static void size_sock_buf(int fd, int opt, int force_opt, int len,
+		const char *name)
+{
+	int granted;
+	socklen_t optlen = sizeof(granted);
+	/* Forcing the size requires CAP_NET_ADMIN */
+	if ((force_opt < 0 ||
+				setsockopt(fd, SOL_SOCKET, force_opt, &len, sizeof(len))) &&
+			setsockopt(fd, SOL_SOCKET, opt, &len, sizeof(len))) {
+		fprintf(stderr, "!! Cannot set the %s buffer size: %s\n", name,
+				strerror(errno));
+		return;
+	}
+	if (getsockopt(fd, SOL_SOCKET, opt, &granted, &optlen)) {
+		fprintf(stderr, "!! Cannot read the %s buffer size: %s\n", name,
+				strerror(errno));
+		return;
+	}
+	/* Linux doubles the size for its bookkeeping, and caps the size to
+	 * net.core.[rw]mem_max unless forced */
+	fprintf(stderr, "%s Socket %s buffer: asked for %d bytes, got %d\n",
+			granted < len ? "!!" : "@@", name, len, granted);
+}
+
+/* Resolve the host the traffic of a link is forwarded to, an IPv4 address
+ * being mapped in IPv6
+ * @return: EXIT_FAILURE if it cannot be resolved */
+static int resolve_forward_host(const struct link *l,
+		struct sockaddr_in6 *addr)
+{
+	struct addrinfo hints, *res;
+	int err;
+	memset(&hints, 0, sizeof(hints));
+	/* An IPv4 socket cannot reach IPv6 hosts */
+	hints.ai_family = sock_family == AF_INET ? AF_INET : AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((err = getaddrinfo(l->forward_host, NULL, &hints, &res))) {
+		fprintf(stderr, "!! Cannot resolve %s: %s\n", l->forward_host,
+				gai_strerror(err));
+		return EXIT_FAILURE;
+	}
+	if (res->ai_family == AF_INET)
+		map_ipv4((struct sockaddr_in*)res->ai_addr, addr);
+	else
+		memcpy(addr, res->ai_addr, sizeof(*addr));
+	addr->sin6_port = htons(l->forward_port);
+	freeaddrinfo(res);
+	return EXIT_SUCCESS;
+}
+
+/* Get the socket of a link,
+ * bind to all interfaces on its port,
+ * resolve the host it forwards to,
  * set as non-blocking,
  * @return: -1 on error or a valid file descriptor.
  */
-static int get_socket()
+static int get_socket(struct link *l)
 {
 
 	const char *err_str;
-	/* Socket creation (IPv6, UDP) */
-	if ((sfd = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
+	int sfd;
+	/* Socket creation (IPv6, UDP), on IPv4 if the system has no IPv6 */
+	if ((sfd = socket(sock_family, SOCK_DGRAM, 0)) < 0 &&
+			errno == EAFNOSUPPORT && sock_family == AF_INET6) {
+		fprintf(stderr, "!! IPv6 is not available, using IPv4\n");
+		sock_family = AF_INET;
+		sfd = socket(AF_INET, SOCK_DGRAM, 0);
+	}
+	if (sfd < 0) {
 		err_str = "Cannot create socket";
 		goto fail;
 	}
-	/* Force the socket to use IPv6,
-	 * enable address sharing: multiple processes can consume data for this
+	/* The loop waits on all the sockets with select() */
+	if (sfd >= FD_SETSIZE) {
+		errno = EMFILE;
+		err_str = "Too many links to wait on";
+		goto fail_socket;
+	}
+	/* Enable address sharing: multiple processes can consume data for this
 	 * IP/port port combination*/
-	int enable = 1;
+	int enable = 1, disable = 0;
 	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable))) {
 		err_str = "Couldn't enable the re-use of the address ...";
 		goto fail_socket;
 	}
-	if (setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(enable))) {
-		err_str = "Cannot force the socket to IPv6";
-		goto fail_socket;
-	}
-	/* Bind the socket to listen on all interfaces (::), on port */
-	struct sockaddr_in6 addr;
-	/* Implicitly set address to ::,
-	 * as well as flowinfo-scope  as they are unwanted here */
+	/* Serve IPv4 hosts as well, as mapped addresses, whatever the default
+	 * of the system */
+	if (sock_family == AF_INET6 && setsockopt(sfd, IPPROTO_IPV6,
+				IPV6_V6ONLY, &disable, sizeof(disable)))
+		perror("!! Cannot serve IPv4 hosts on the IPv6 socket");
+	/* Bind the socket to listen on all interfaces (:: or 0.0.0.0), on port.
+	 * Implicitly set address to any, as well as flowinfo-scope as they are
+	 * unwanted here */
+	union {
+		struct sockaddr_in6 in6;
+		struct sockaddr_in in;
+	} addr;
+	socklen_t addr_len;
 	memset(&addr, 0, sizeof(addr));
-	addr.sin6_family = AF_INET6;
-	addr.sin6_port = htons(port);
-	if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+	if (sock_family == AF_INET6) {
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_port = htons(l->port);
+		addr_len = sizeof(addr.in6);
+	} else {
+		addr.in.sin_family = AF_INET;
+		addr.in.sin_port = htons(l->port);
+		addr_len = sizeof(addr.in);
+	}
+	if (bind(sfd, (struct sockaddr*)&addr, addr_len) < 0) {
 		err_str = "Cannot bind socket";
 		goto fail_socket;
 	}
-	/* Initialize the dest_addr struct (loopback, forward_port).
+	/* Resolve the host we forward to.
 	 * Cannot connect as we will receive/send data from/to multiple hosts */
-	memset(&dest_addr, 0, sizeof(dest_addr));
-	dest_addr.sin6_family = AF_INET6;
-	dest_addr.sin6_port = htons(forward_port);
-	memcpy(&dest_addr.sin6_addr, &in6addr_loopback,
-			sizeof(dest_addr.sin6_addr));
+	struct sockaddr_in6 dest;
+	if (resolve_forward_host(l, &dest)) {
+		close(sfd);
+		return -1;
+	}
+	set_peer(&l->dest_peer, &dest);
+	fprintf(stderr, "@@ Forwarding port %d to %s [%d]\n", l->port,
+			sockaddr6_to_human(&dest.sin6_addr), l->forward_port);
 	/* Set the socket to non-blocking,
 	 * as select() indicates that a socket is ready to be read, but not that it
 	 * will not block. */
@@ -428,7 +1428,70 @@ static int get_socket()
 		err_str = "Cannot set the socket to non-blocking mode";
 		goto fail_socket;
 	}
-	return sfd;
+	/* Receive coalesced datagrams, which also tells the kernel that we
+	 * can handle batches */
+	if (use_gso) {
+#ifdef HAVE_UDP_GSO
+		if (setsockopt(sfd, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable))) {
+			perror("!! Cannot enable UDP GRO");
+			use_gso = 0;
+		}
+#else
+		use_gso = 0;
+#endif
+		fprintf(stderr, use_gso ? "@@ Using UDP GRO/GSO\n" :
+				"!! UDP GRO/GSO is not available, disabling it\n");
+	}
+	if (rcvbuf_len)
+		size_sock_buf(sfd, SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf_len, "receive");
+	if (sndbuf_len)
+		size_sock_buf(sfd, SO_SNDBUF, SO_SNDBUFFORCE, sndbuf_len, "send");
+	/* Tell apart the datagrams the kernel dropped from those the link did */
+#ifdef SO_RXQ_OVFL
+	if (setsockopt(sfd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)))
+		perror("!! Cannot enable SO_RXQ_OVFL, the kernel drops will not be "
+				"reported");
+#endif
+	/* Date the packets when they reach the socket */
+#ifdef HAVE_RX_TIMESTAMPS
+	if (setsockopt(sfd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)))
+		perror("!! Cannot enable SO_TIMESTAMPNS, dating packets when they "
+				"are read");
+	else
+		rx_timestamps = 1;
+#endif
+	/* Let the qdisc delay the packets */
+	if (use_txtime) {
+#ifdef HAVE_TXTIME
+		struct sock_txtime txtime = { .clockid = CLOCK_MONOTONIC };
+		if (setsockopt(sfd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime))) {
+			perror("!! Cannot enable SO_TXTIME");
+			use_txtime = 0;
+		}
+#else
+		use_txtime = 0;
+#endif
+		fprintf(stderr, use_txtime ? "@@ Delaying packets in the kernel "
+				"with SO_TXTIME, the outgoing device must use the fq qdisc\n" :
+				"!! SO_TXTIME is not available, delaying packets in "
+				"userspace\n");
+	}
+	/* Let the kernel busy-poll the device queue when we wait for packets */
+	if (sock_busy_poll) {
+#ifdef SO_BUSY_POLL
+		socklen_t optlen = sizeof(sock_busy_poll);
+		if (setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &sock_busy_poll,
+					sizeof(sock_busy_poll)) ||
+				getsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &sock_busy_poll,
+					&optlen))
+			perror("!! Cannot set SO_BUSY_POLL");
+		else
+			fprintf(stderr, "@@ SO_BUSY_POLL set to %d us\n", sock_busy_poll);
+#else
+		fprintf(stderr, "!! SO_BUSY_POLL is not available\n");
+#endif
+	}
+	return l->sfd = sfd;
 
 fail_socket:
 	close(sfd);
@@ -437,16 +1500,323 @@ fail:
 	return -1;
 }
 
- /* ? a > b */
-static int pkt_slot_cmp(const void *a, const void *b)
+/* Stop gracefully on SIGINT/SIGTERM to report our statistics,
+ * and reload the configuration file on SIGHUP */
+static int install_signal_handlers()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, NULL) || sigaction(SIGTERM, &sa, NULL))
+		return -1;
+	/* Reload the parameters on SIGHUP */
+	if (config_path) {
+		sa.sa_handler = handle_reload;
+		return sigaction(SIGHUP, &sa, NULL);
+	}
+	return 0;
+}
+
+/* Give the link the shape of the empirical delay distribution */
+static int load_histogram(struct link *l)
+{
+	double *values, *weights;
+	size_t n;
+	int err;
+	if (config_load_histogram(histogram_path, &values, &weights, &n))
+		return EXIT_FAILURE;
+	if ((err = linksim_set_delay_histogram(l->sim, values, weights, n)))
+		fprintf(stderr, "!! %s does not hold any measured delay\n",
+				histogram_path);
+	else
+		fprintf(stderr, "@@ Loaded a histogram of %zu delay(s) from %s\n", n,
+				histogram_path);
+	free(values);
+	free(weights);
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Map a delivery trace in memory, and make the link follow it. The trace is
+ * not read upfront: the pages are loaded as the link goes through them.
+ * @return: non-zero value on error
+ */
+static int load_trace(struct link *l, int direction)
+{
+	struct trace_file *t = &l->traces[direction - 1];
+	const char *path = trace_paths[direction - 1];
+	struct stat st;
+	int fd;
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+		perror(path);
+		goto fail;
+	}
+	t->len = st.st_size;
+	if (!t->len || (t->data = mmap(NULL, t->len, PROT_READ, MAP_PRIVATE,
+					fd, 0)) == MAP_FAILED) {
+		t->data = NULL;
+		fprintf(stderr, "!! Cannot map %s: %s\n", path,
+				t->len ? strerror(errno) : "empty file");
+		goto fail;
+	}
+	/* The trace is read sequentially */
+	posix_madvise(t->data, t->len, POSIX_MADV_SEQUENTIAL);
+	close(fd);
+	if (linksim_set_trace(l->sim, direction, t->data, t->len)) {
+		fprintf(stderr, "!! %s is not a valid trace\n", path);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "@@ Following the trace %s (%s)\n", path,
+			linksim_direction_str(direction));
+	return EXIT_SUCCESS;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	return EXIT_FAILURE;
+}
+
+/* Record and/or replay the decisions of the link
+ * @return: non-zero value on error
+ */
+static int open_decision_logs(struct link *l)
+{
+	struct linksim_decider d;
+	memset(&d, 0, sizeof(d));
+	/* Only the live links cannot wait for the disk */
+	if (record_path && !(l->record_log = declog_open_write(record_path,
+					!pcap_out))) {
+		perror(record_path);
+		return EXIT_FAILURE;
+	}
+	if (replay_path) {
+		if (!(l->replay_log = declog_open_read(replay_path))) {
+			fprintf(stderr, "!! Cannot load the decision log %s\n",
+					replay_path);
+			return EXIT_FAILURE;
+		}
+		fprintf(stderr, "@@ Replaying %zu decision(s) from %s\n",
+				declog_size(l->replay_log), replay_path);
+	}
+	d.record = l->record_log ? declog_record : NULL;
+	d.replay = l->replay_log ? declog_replay : NULL;
+	d.arg = l->record_log ? l->record_log : l->replay_log;
+	linksim_set_decider(l->sim, &d);
+	return EXIT_SUCCESS;
+}
+
+/* Destroy the simulated link, and release its traces, rules and logs */
+static void destroy_link(struct link *l)
+{
+	int i;
+	linksim_del(l->sim);
+	l->sim = NULL;
+	if (l->record_log) {
+		if (declog_close(l->record_log))
+			fprintf(stderr, "!! Some decisions could not be written to "
+					"%s\n", record_path);
+		else
+			fprintf(stderr, "@@ Recorded the decisions to %s\n",
+					record_path);
+	}
+	declog_close(l->replay_log);
+	l->record_log = l->replay_log = NULL;
+	for (i = 0; i < 2; ++i) {
+		if (l->traces[i].data)
+			munmap(l->traces[i].data, l->traces[i].len);
+		l->traces[i].data = NULL;
+	}
+	config_free_rules(l->rules, l->nrules);
+	l->rules = NULL;
+	l->nrules = 0;
+}
+
+/* Create the simulated link
+ * @return: non-zero value on error
+ */
+static int create_link(struct link *l, unsigned long seed)
+{
+	if (!(l->sim = linksim_new(&l->params, seed)))
+		return EXIT_FAILURE;
+	linksim_set_log(l->sim, stderr);
+	linksim_set_proto(l->sim, proto);
+	if (linksim_reserve(l->sim, queue_capacity))
+		goto fail;
+	if (histogram_path && load_histogram(l))
+		goto fail;
+	if (set_direction_params(l, &l->params))
+		goto fail;
+	if (schedule_path) {
+		struct linksim_step *steps;
+		size_t n;
+		if (config_load_schedule(schedule_path, &l->params, &steps, &n))
+			goto fail;
+		if (linksim_set_schedule(l->sim, steps, n)) {
+			free(steps);
+			goto fail;
+		}
+		fprintf(stderr, "@@ Loaded %zu step(s) from %s\n", n, schedule_path);
+		free(steps);
+	}
+	if ((trace_paths[0] && load_trace(l, LINK_FORWARD)) ||
+			(trace_paths[1] && load_trace(l, LINK_REVERSE)))
+		goto fail;
+	if (rules_path) {
+		if (config_load_rules(rules_path, &l->rules, &l->nrules))
+			goto fail;
+		if (linksim_set_rules(l->sim, l->rules, l->nrules)) {
+			perror("Cannot set the rules");
+			goto fail;
+		}
+		fprintf(stderr, "@@ Loaded %zu rule(s) from %s\n", l->nrules,
+				rules_path);
+	}
+	if ((record_path || replay_path) && open_decision_logs(l))
+		goto fail;
+	return EXIT_SUCCESS;
+
+fail:
+	destroy_link(l);
+	return EXIT_FAILURE;
+}
+
+/* Live mode: open the socket of a link, then create it
+ * @return: non-zero value on error
+ */
+static int open_link(struct link *l, unsigned long seed)
+{
+	if (get_socket(l) < 0) {
+		fprintf(stderr, "Socket initialization failure!\n");
+		return EXIT_FAILURE;
+	}
+	if (alloc_backlogs(l)) {
+		fprintf(stderr, "Cannot create the send backlogs!\n");
+		goto fail;
+	}
+	if (create_link(l, seed)) {
+		fprintf(stderr, "Cannot create the simulated link!\n");
+		goto fail;
+	}
+	return EXIT_SUCCESS;
+
+fail:
+	free_backlogs(l);
+	close(l->sfd);
+	return EXIT_FAILURE;
+}
+
+/* Live mode: destroy a link, and close its socket */
+static void close_link(struct link *l)
 {
-	struct timeval *left = &((struct pkt_slot*)a)->ts;
-	struct timeval *right = &((struct pkt_slot*)b)->ts;
-	/* We compare the slots based on their (future) expiration date */
-	return timeval_cmp(left, right);
+	destroy_link(l);
+	free_backlogs(l);
+	close(l->sfd);
+}
+
+/* Keep the data path from migrating, being preempted or faulting pages in,
+ * as far as the system allows it. What is not granted is reported, and the
+ * links run anyway. */
+static void setup_realtime()
+{
+	size_t n = queue_capacity ? queue_capacity : DEFAULT_POOL_LEN, i;
+	if (pin_cpus)
+		rt_pin_cpus(pin_cpus);
+	if (fifo_priority)
+		rt_set_fifo(fifo_priority);
+	if (!lock_memory)
+		return;
+	/* A single pool for all the links, which rarely are all busy at once */
+	if (!(pkt_pool = linksim_pool_new(n, max_pkt_len))) {
+		perror("Cannot preallocate the packets");
+	} else {
+		for (i = 0; i < nlinks; ++i)
+			if (linksim_reserve(links[i].sim, n) ||
+					linksim_set_pool(links[i].sim, pkt_pool))
+				fprintf(stderr, "!! Cannot preallocate the queues of port "
+						"%d\n", links[i].port);
+		fprintf(stderr, "@@ Preallocated %zu packet(s) of %zu bytes\n", n,
+				max_pkt_len);
+	}
+	/* Also faults in the queue and buffers allocated so far */
+	rt_lock_memory();
 }
 
-static int proxy_traffic()
+/* Report the statistics of a link */
+static void print_link_stats(const struct link *l)
+{
+	struct linksim_stats st;
+	size_t i;
+	linksim_get_stats(l->sim, &st);
+	if (nlinks > 1)
+		fprintf(stderr, "@@ Port %d, forwarding to %s [%d]:\n", l->port,
+				l->forward_host, l->forward_port);
+	fprintf(stderr, "@@ Link: %" PRIu64 " packet(s) received, %" PRIu64
+			" dropped, %" PRIu64 " cut, %" PRIu64 " corrupted, %" PRIu64
+			" delayed\n"
+			"@@ Queue: %zu element(s) left, peak of %zu, "
+			"capacity of %zu slot(s)\n", st.received, st.dropped, st.cut,
+			st.corrupted, st.delayed, st.queued, st.queue_peak,
+			st.queue_capacity);
+	if (st.flipped)
+		fprintf(stderr, "@@ Corruption: %" PRIu64 " bit(s) flipped\n",
+				st.flipped);
+	for (i = 0; i < l->nrules; ++i)
+		fprintf(stderr, "@@ Rule #%zu matched %" PRIu64 " packet(s)\n",
+				i + 1, linksim_rule_matches(l->sim, i));
+	if (l->record_log)
+		fprintf(stderr, "@@ Recorded %zu decision(s)\n",
+				declog_size(l->record_log));
+	if (l->record_log && declog_dropped(l->record_log))
+		fprintf(stderr, "!! Dropped %zu decision(s), as the log could not "
+				"be written fast enough\n", declog_dropped(l->record_log));
+	if (l->replay_log)
+		fprintf(stderr, "@@ %zu packet(s) were not in the decision log\n",
+				declog_misses(l->replay_log));
+	for (i = 0; i < 2; ++i)
+		if (l->tx_states[i].sent)
+			fprintf(stderr, "@@ Delayed packets (%s): %zu sent, %" PRIu64
+					" us late on average, %" PRIu64 " us at most, %zu more "
+					"than 1 ms late\n", linksim_direction_str(i + 1),
+					l->tx_states[i].sent, l->tx_states[i].late_us /
+					l->tx_states[i].sent, l->tx_states[i].late_max_us,
+					l->tx_states[i].late);
+	for (i = 0; i < 2; ++i)
+		if (l->backlogs[i].queued)
+			fprintf(stderr, "@@ Send backlog (%s): %zu datagram(s) queued, "
+					"%zu dropped, peak of %zu\n",
+					linksim_direction_str(i + 1), l->backlogs[i].queued,
+					l->backlogs[i].dropped, l->backlogs[i].peak);
+	if (l->kernel_drops)
+		fprintf(stderr, "!! Kernel: %" PRIu32 " datagram(s) dropped as the "
+				"socket receive queue was full, before reaching the link\n",
+				l->kernel_drops);
+	if (l->rx_stamped)
+		fprintf(stderr, "@@ Kernel arrival dates: %zu packet(s), read "
+				"%.1f us after their arrival on average\n", l->rx_stamped,
+				(double)l->rx_wait_us / l->rx_stamped);
+	if (l->gro_pkts || l->gso_pkts)
+		fprintf(stderr, "@@ UDP GRO: %zu packet(s) split into %zu datagrams, "
+				"GSO: %zu send(s) of %zu datagrams\n", l->gro_pkts,
+				l->gro_segs, l->gso_pkts, l->gso_segs);
+	if (l->truncated_pkts)
+		fprintf(stderr, "!! %zu datagram(s) larger than %zu bytes have been "
+				"truncated\n", l->truncated_pkts, max_pkt_len);
+}
+
+/* Report the statistics of each link, then those of the process */
+static void print_stats()
+{
+	size_t i;
+	for (i = 0; i < nlinks; ++i)
+		print_link_stats(&links[i]);
+	if (busy_poll)
+		fprintf(stderr, "@@ Busy-polling: %" PRIu64 ".%06" PRIu64 " s "
+				"spinning, %" PRIu64 ".%06" PRIu64 " s sleeping in %zu "
+				"wait(s)\n", spin_us / 1000000, spin_us % 1000000,
+				sleep_us / 1000000, sleep_us % 1000000, busy_sleeps);
+}
+
+static int proxy_traffic(unsigned long seed)
 {
 #define _DIE(label, msg, ...) do { \
 	fprintf(stderr, msg, ##__VA_ARGS__); \
@@ -455,22 +1825,76 @@ static int proxy_traffic()
 } while (0)
 
 	int rval = EXIT_SUCCESS;
+	size_t opened; /* How many links have been opened */
 
-	if (get_socket() < 0)
-		_DIE(exit, "Socket initialization failure!\n");
+	/* Each link draws from its own generator */
+	for (opened = 0; opened < nlinks; ++opened)
+		if (open_link(&links[opened], seed + opened))
+			_DIE(links, "Cannot open the link on port %d!\n",
+					links[opened].port);
 
-	if (!(pkt_queue = minq_new(pkt_slot_cmp)))
-		_DIE(sfd, "Cannot create priority queue!\n");
+	if (install_signal_handlers())
+		_DIE(links, "Cannot install the signal handlers!\n");
 
-	/* Process incoming traffic until error (or forever) */
-	if ((rval = proxy_loop()))
-		_DIE(queue, "The proxy loop crashed, "
-			"had %zu element(s) left in pkt_queue\n", minq_size(pkt_queue));
+	setup_realtime();
 
-queue:
-	minq_del(pkt_queue);
-sfd:
-	close(sfd);
+	/* Process incoming traffic until error (or until asked to stop) */
+	if ((rval = busy_poll ? busy_loop() : proxy_loop()))
+		fprintf(stderr, "The proxy loop crashed!\n");
+
+	print_stats();
+
+links:
+	while (opened)
+		close_link(&links[--opened]);
+	/* The links have given their packets back */
+	linksim_pool_del(pkt_pool);
+	return rval;
+
+#undef _DIE
+}
+
+/* Offline mode: simulate the link on a capture file instead of sockets */
+static int replay_capture(unsigned long seed)
+{
+#define _DIE(label, msg, ...) do { \
+	fprintf(stderr, msg, ##__VA_ARGS__); \
+	rval = EXIT_FAILURE; \
+	goto label; \
+} while (0)
+
+	int rval = EXIT_SUCCESS;
+
+	if (!(pcap_in = pcap_open_read(pcap_in_path)))
+		_DIE(exit, "Cannot read the capture file %s!\n", pcap_in_path);
+
+	if (!(pcap_out = pcap_open_write(pcap_out_path,
+					pcap_linktype(pcap_in))))
+		_DIE(pcap_in, "Cannot create the capture file %s!\n",
+				pcap_out_path);
+
+	if (create_link(links, seed))
+		_DIE(pcap_out, "Cannot create the simulated link!\n");
+
+	if (install_signal_handlers())
+		_DIE(link, "Cannot install the signal handlers!\n");
+
+	if ((rval = replay_loop()))
+		fprintf(stderr, "The replay crashed!\n");
+
+	fprintf(stderr, "@@ Replayed %zu packet(s): %zu skipped, %zu written\n",
+			pcap_read_pkts, pcap_skipped_pkts, pcap_written_pkts);
+	print_stats();
+
+link:
+	destroy_link(links);
+pcap_out:
+	if (pcap_close(pcap_out)) {
+		perror("Cannot write the output capture");
+		rval = EXIT_FAILURE;
+	}
+pcap_in:
+	pcap_close(pcap_in);
 exit:
 	return rval;
 
@@ -482,16 +1906,36 @@ static void usage(const char *prog_name)
 	fprintf(stderr,
 "Link sim: A simple lossy link simulator.\n"
 "This program will relay all incoming UDP traffic on port `port` to\n"
-"the loopback address [::1], on port `forward_port`, simulating \n"
-"random losses, transmission errors, ...\n"
+"`forward_host` (the loopback address [::1] by default), on port\n"
+"`forward_port`, simulating random losses, transmission errors, ...\n"
 "\n"
-"Usage: %s [-p port] [-P forward_port] [-d delay] [-j jitter]\n"
-"       %*s [-e err_rate] [-c cut_rate] [-l loss_rate] [-s seed] [-h]\n"
+"Usage: %s [-p port] [-E forward_host] [-P forward_port] [-d delay]\n"
+"       %*s [-j jitter] [-e err_rate] [-C model] [-c cut_rate]\n"
+"       %*s [-l loss_rate] [-s seed] [-b rate] [-q capacity] [-m max_size]\n"
+"       %*s [-g] [-x protocol] [-i input.pcap -o output.pcap] [-h]\n"
+"       %*s [-f config] [-S schedule] [-F rules] [-t trace] [-T trace]\n"
+"       %*s [-w decisions | -W decisions] [-a cpus] [-u priority] [-L]\n"
+"       %*s [-y window] [-k busy_poll] [-Q backlog] [-z]\n"
+"       %*s [-B rcvbuf] [-O sndbuf] [-M links]\n"
+"       %*s [-D distribution] [-H histogram] [-n] [-A dir:params]\n"
 "-p port          The UDP port on which the link simulator operates.\n"
 "                 Defaults to: 1341\n"
-"-P forward_port  The UDP port on localhost on which the incoming traffic\n"
-"                 should be forwarded.\n"
+"-E forward_host  The host, name or IPv4/IPv6 address, to which the\n"
+"                 incoming traffic should be forwarded. The link serves\n"
+"                 IPv4 and IPv6 hosts on the same socket.\n"
+"                 Defaults to: ::1\n"
+"-P forward_port  The UDP port on forward_host on which the incoming\n"
+"                 traffic should be forwarded.\n"
 "                 Defaults to: 12345\n"
+"-M links         Serve several links at once, from a file holding a\n"
+"                 'port forward_host forward_port' line per link,\n"
+"                 followed by its 'key=value' parameters, applied to\n"
+"                 those of the command line. The links share a single\n"
+"                 loop, timer and pool of packets (with -L), the other\n"
+"                 options apply to each of them, and each draws from its\n"
+"                 own generator (seed, seed + 1, ...). Their statistics\n"
+"                 are reported apart. Not available in offline mode, nor\n"
+"                 with -w or -W.\n"
 "-d delay         The delay (in ms) that should be applied to the traffic.\n"
 "                 Defaults to: 0\n"
 "-j jitter        The jitter (in ms) that should be applied to the traffic.\n"
@@ -499,24 +1943,151 @@ static void usage(const char *prog_name)
 "                 delay + rand[-jitter, jitter].\n"
 "                 Defaults to: 0\n"
 "                 Unused if delay == 0.\n"
+"-D distribution  How the delay varies around its mean: uniform (as -j\n"
+"                 tells), normal, pareto, paretonormal or empirical, with\n"
+"                 jitter as standard deviation. Add :corr to correlate\n"
+"                 the delay of a packet with the previous one by corr %%,\n"
+"                 e.g. normal:25.\n"
+"                 Defaults to: uniform\n"
+"-H histogram     The measured delays that give their shape to the\n"
+"                 empirical distribution: 'value [count]' lines.\n"
+"-n               Keep the packets of each direction in order: a packet\n"
+"                 whose delay would make it overtake the previous one\n"
+"                 leaves right after it instead, as from a single queue.\n"
+"-A dir:params    Give a direction, forward or reverse, its own\n"
+"                 parameters: a comma-separated list of key=value, with\n"
+"                 the keys of a config file, applied to the parameters\n"
+"                 of the link. The direction is then simulated, e.g.\n"
+"                 -A reverse:rate=5000,loss_rate=2 for a slow, lossy\n"
+"                 uplink. Each direction draws from its own random\n"
+"                 generator.\n"
 "-e err_rate      The rate of packet corruption occurrence (in packet/100).\n"
 "                 Defaults to: 0\n"
 "                 A packet that has been corrupted will NOT be cut.\n"
+"-C model         How packets are corrupted: byte (invert one byte), bit\n"
+"                 (flip one bit), burst:len (corrupt a burst of len bits,\n"
+"                 whose first and last bits are flipped, the others with\n"
+"                 probability 1/2), or ber:p (flip each bit independently\n"
+"                 with probability p, e.g. ber:1e-6, regardless of\n"
+"                 err_rate).\n"
+"                 Defaults to: byte\n"
 "-c cut_rate      The rate of packet being cut after the header to simulate\n"
 "                 router truncation due to high network load (in packet/100).\n"
 "                 Defaults to: 0\n"
 "                 A packet that has been cut will NOT be corrupted.\n"
 "-l loss_rate     The rate of packets loss (in packet/100).\n"
 "                 Defaults to 0\n"
+"-b rate          The bandwidth of the link (in kbit/s). Packets are queued\n"
+"                 until the link has transmitted the previous ones.\n"
+"                 Defaults to: 0 (unlimited)\n"
 "-s seed          The seed for the random generator, to replay a previous\n"
 "                 session.\n"
 "                 Defaults to: time() casted to int\n"
+"-q capacity      How many delayed packets the queue can hold before\n"
+"                 having to grow. Pre-sizing it avoids reallocations\n"
+"                 when a burst of packets is delayed at startup.\n"
+"                 Defaults to: 20\n"
+"-m max_size      The size (in bytes) of the largest datagram to relay,\n"
+"                 up to 65527. Larger ones are truncated.\n"
+"                 Defaults to: 528\n"
+"-x protocol      The protocol of the relayed datagrams, to describe them\n"
+"                 in the log and to cut them after their header: trtp (the\n"
+"                 protocol of the project), quic, or raw (opaque datagrams,\n"
+"                 never cut).\n"
+"                 Defaults to: trtp\n"
+"-g               Use UDP GRO and GSO (Linux): receive the datagrams that\n"
+"                 the kernel coalesced, then split them to simulate the\n"
+"                 link on each of them, and send the consecutive datagrams\n"
+"                 forwarded to the same host at once. This reduces the\n"
+"                 cost per datagram at high rates.\n"
+"-i input.pcap    Offline mode: instead of proxying live traffic, replay\n"
+"                 the UDP datagrams of a capture file through the link,\n"
+"                 as fast as possible. The capture dates are used as the\n"
+"                 clock, thus the result only depends on the seed.\n"
+"                 Datagrams sent to forward_port are the forward path,\n"
+"                 those sent from it the reverse path.\n"
+"-o output.pcap   Offline mode: where to write the resulting capture.\n"
+"-f config        Read the parameters of the link from a file, containing\n"
+"                 'key = value' lines, where key is one of delay, jitter,\n"
+"                 err_rate, corruption (byte, bit, burst or ber), ber,\n"
+"                 burst_len, cut_rate, loss_rate, rate or link_direction\n"
+"                 (forward, reverse or both). These override the command\n"
+"                 line, and are reloaded on SIGHUP without interrupting\n"
+"                 the link: queued packets are kept, and the new values\n"
+"                 apply to the packets received afterwards.\n"
+"-S schedule      Make the parameters vary over time, starting with the\n"
+"                 first packet. Each line of the file holds a date (in ms,\n"
+"                 or in s with a 's' suffix) followed by the 'key=value'\n"
+"                 parameters that change at that date. With 'ramp' on the\n"
+"                 line, they change linearly from the previous line.\n"
+"-F rules         Give their own parameters to the packets matching a\n"
+"                 filter. Each line of the file holds a filter, then ':'\n"
+"                 and the 'key=value' parameters of the matching packets,\n"
+"                 e.g. 'dir == reverse && byte[0] >> 6 == 2 : loss_rate=50'.\n"
+"                 Filters compare len, dir (forward or reverse) and the\n"
+"                 big-endian fields byte[i], u16[i] and u32[i] of the\n"
+"                 packet, masked with '&' or shifted with '>>', using\n"
+"                 ==, !=, <, <=, >, >=, &&, ||, ! and parentheses.\n"
+"                 A packet gets the parameters of the first rule it\n"
+"                 matches, those not given being that of a perfect link.\n"
+"-t trace         Make the capacity of the link follow a delivery trace,\n"
+"                 in the format of Mahimahi: each line holds the date (in\n"
+"                 ms) at which 1504 bytes can be sent. The trace loops,\n"
+"                 starting with the first packet, and replaces the rate.\n"
+"-T trace         Likewise, for the reverse path (with -r or -R).\n"
+"-w decisions     Record what the link does to each packet in a compact\n"
+"                 binary log, keyed by the content of the packets. When\n"
+"                 proxying, the records that cannot be written fast\n"
+"                 enough are dropped rather than stalling the link.\n"
+"-W decisions     Replay a log recorded with -w: each packet gets the\n"
+"                 decision recorded for the same packet, whatever the\n"
+"                 order in which the packets arrive. The packets that are\n"
+"                 not in the log are handled as usual.\n"
+"-a cpus          Pin the process to a list of CPUs, e.g. 2 or 0-3,6.\n"
+"-u priority      Run with the SCHED_FIFO real-time policy, at that\n"
+"                 priority (1-99 on Linux). Usually requires privileges.\n"
+"-L               Preallocate the delayed packets (as many as the\n"
+"                 capacity, 1024 by default) and lock the memory, so\n"
+"                 that the link does not fault pages in.\n"
+"                 These three options apply to the live mode, reduce the\n"
+"                 latency noise of the link, and report what the system\n"
+"                 granted. The link runs anyway if they are denied.\n"
+"-y window        Busy-poll: spin on the socket and the queue instead of\n"
+"                 sleeping until the next event, for precise dates. Spin\n"
+"                 until no packet was received for window us, then sleep\n"
+"                 until window us before the next expiration date.\n"
+"                 0 never sleeps, and keeps a CPU busy.\n"
+"-z               Hand the delayed packets to the kernel right away, with\n"
+"                 their departure date (SO_TXTIME, Linux), instead of\n"
+"                 waking up to send each of them. The fq qdisc must be\n"
+"                 set on the outgoing device, e.g. with\n"
+"                 'tc qdisc replace dev lo root fq', as other qdiscs send\n"
+"                 the packets right away. Falls back to delaying them in\n"
+"                 userspace if SO_TXTIME is not available.\n"
+"-Q backlog       How many datagrams to keep per direction when the\n"
+"                 socket cannot send them right away. Datagrams are\n"
+"                 dropped when the backlog is full.\n"
+"                 Defaults to: 64\n"
+"-k busy_poll     Set SO_BUSY_POLL (in us) on the socket, for the kernel\n"
+"                 to busy-poll the device when waiting for packets.\n"
+"-B rcvbuf        The size (in bytes) of the socket receive buffer, that\n"
+"                 holds the datagrams the link has not read yet. Beyond\n"
+"                 net.core.rmem_max if the process may (CAP_NET_ADMIN).\n"
+"                 The datagrams the kernel drops when it is full are\n"
+"                 reported apart from those dropped by the link.\n"
+"-O sndbuf        Likewise, for the socket send buffer.\n"
 "-r               Simulate the link on the reverse path.\n"
 "-R               Simulate the link in both ways.\n"
 "-h               Prints this message and exit.\n",
 			prog_name,
-			(int)strlen(prog_name),
-			"");
+			(int)strlen(prog_name), "",
+			(int)strlen(prog_name), "",
+			(int)strlen(prog_name), "",
+			(int)strlen(prog_name), "",
+			(int)strlen(prog_name), "",
+			(int)strlen(prog_name), "",
+			(int)strlen(prog_name), "",
+			(int)strlen(prog_name), "");
 }
 
 static long parse_number(const char *val)
@@ -528,12 +2099,164 @@ static long parse_number(const char *val)
 	return parsed;
 }
 
+/* Parse a non-negative count, rejecting any trailing characters
+ * @return: non-zero value if the count is invalid
+ */
+static int parse_size(const char *val, size_t *out)
+{
+	char *c;
+	unsigned long long parsed;
+	while (isspace((unsigned char)*val))
+		++val;
+	if (*val == '-')
+		return -1;
+	errno = 0;
+	parsed = strtoull(val, &c, 0);
+	if (c == val || *c != '\0' || errno || parsed > SIZE_MAX)
+		return -1;
+	*out = parsed;
+	return 0;
+}
+
+/* Set the corruption model from its description, byte, bit, burst:len or
+ * ber:p
+ * @return: non-zero value if the model is invalid
+ */
+static int parse_corruption(char *model)
+{
+	char *arg = strchr(model, ':');
+	if (arg)
+		*arg++ = '\0';
+	if (config_set(&params, "corruption", model))
+		return -1;
+	switch (params.corruption) {
+		case LINKSIM_CORRUPT_BURST:
+			return arg && config_set(&params, "burst_len", arg);
+		case LINKSIM_CORRUPT_BER:
+			return !arg || config_set(&params, "ber", arg);
+		default:
+			return arg != NULL;
+	}
+}
+
+/* Give a direction its own parameters, from forward:list or reverse:list
+ * where list is a comma-separated list of key=value
+ * @return: non-zero value if the description is invalid
+ */
+static int parse_direction_params(const char *desc)
+{
+	struct linksim_params p = params;
+	const char *list = strchr(desc, ':');
+	int direction;
+	/* Both names have the same length */
+	if (!list || list - desc != (long)strlen("forward"))
+		return -1;
+	if (!strncmp(desc, "forward", list - desc))
+		direction = LINK_FORWARD;
+	else if (!strncmp(desc, "reverse", list - desc))
+		direction = LINK_REVERSE;
+	else
+		return -1;
+	if (config_set_list(&p, ++list))
+		return -1;
+	dir_lists[direction - 1] = list;
+	return 0;
+}
+
+/* Set the delay distribution from its description, dist or dist:corr
+ * @return: non-zero value if the distribution is invalid
+ */
+static int parse_dist(char *dist)
+{
+	char *arg = strchr(dist, ':');
+	if (arg)
+		*arg++ = '\0';
+	return config_set(&params, "delay_dist", dist) ||
+		(arg && config_set(&params, "delay_corr", arg));
+}
+
+/* Describe the delay distribution of p
+ * @return: buf */
+static const char *dist_str(const struct linksim_params *p, char *buf,
+		size_t len)
+{
+	if (p->delay_corr)
+		snprintf(buf, len, "%s:%u", linksim_dist_str(p->delay_dist),
+				p->delay_corr);
+	else
+		snprintf(buf, len, "%s", linksim_dist_str(p->delay_dist));
+	return buf;
+}
+
+/* Describe the corruption model of p
+ * @return: buf */
+static const char *corruption_str(const struct linksim_params *p,
+		char *buf, size_t len)
+{
+	if (p->corruption == LINKSIM_CORRUPT_BURST)
+		snprintf(buf, len, "burst:%u", p->burst_len);
+	else if (p->corruption == LINKSIM_CORRUPT_BER)
+		snprintf(buf, len, "ber:%g", p->ber);
+	else
+		snprintf(buf, len, "%s", linksim_corruption_str(p->corruption));
+	return buf;
+}
+
+/* Define the links to simulate, those of links_path or the one of the
+ * command line, and apply the configuration file to their parameters
+ * @return: non-zero value on error
+ */
+static int define_links()
+{
+	struct link *l;
+	size_t i;
+	if (links_path) {
+		if (config_load_links(links_path, &params, &link_defs, &nlinks))
+			return EXIT_FAILURE;
+	} else {
+		nlinks = 1;
+	}
+	if (!(links = calloc(nlinks, sizeof(*links)))) {
+		perror("Cannot allocate the links");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nlinks; ++i) {
+		l = &links[i];
+		if (link_defs) {
+			l->port = link_defs[i].port;
+			l->forward_host = link_defs[i].forward_host;
+			l->forward_port = link_defs[i].forward_port;
+			l->base_params = link_defs[i].params;
+		} else {
+			l->port = port;
+			l->forward_host = forward_host;
+			l->forward_port = forward_port;
+			l->base_params = params;
+		}
+		l->sfd = -1;
+		l->params = l->base_params;
+		if (config_path && config_load(config_path, &l->params))
+			return EXIT_FAILURE;
+		if (l->params.delay_dist == LINKSIM_DIST_EMPIRICAL &&
+				!histogram_path) {
+			fprintf(stderr, "!! The empirical delay distribution requires a "
+					"histogram, see -H\n");
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
-	int opt;
+	char model[32], dist[32];
+	const struct linksim_params *p;
+	struct link *l;
+	int opt, rval;
 	long seed = -1L;
+	linksim_params_init(&params);
 	/* parse option values */
-	while ((opt = getopt(argc, argv, "p:P:d:j:e:c:s:l:hrR")) != -1) {
+	while ((opt = getopt(argc, argv, "p:P:d:j:e:C:c:s:l:b:q:m:gx:i:o:f:S:F:t:T:w:W:a:u:Ly:k:Q:zB:O:D:H:nA:E:M:hrR")) != -1) {
 		switch (opt) {
 			case 'p':
 				port = parse_number(optarg) & ((1 << 16) - 1);
@@ -541,29 +2264,143 @@ int main(int argc, char **argv)
 			case 'P':
 				forward_port = parse_number(optarg) & ((1 << 16) - 1);
 				break;
+			case 'E':
+				forward_host = optarg;
+				break;
 			case 'd':
-				delay = parse_number(optarg);
+				params.delay = parse_number(optarg);
 				break;
 			case 'j':
-				jitter = parse_number(optarg);
+				params.jitter = parse_number(optarg);
+				break;
+			case 'D':
+				if (parse_dist(optarg)) {
+					fprintf(stderr, "!! Invalid delay distribution %s\n",
+							optarg);
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'H':
+				histogram_path = optarg;
+				break;
+			case 'n':
+				params.in_order = 1;
+				break;
+			case 'A':
+				if (parse_direction_params(optarg)) {
+					fprintf(stderr, "!! Invalid direction parameters %s\n",
+							optarg);
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
 				break;
 			case 'e':
-				err_rate = parse_number(optarg) % 101;
+				params.err_rate = parse_number(optarg) % 101;
+				break;
+			case 'C':
+				if (parse_corruption(optarg)) {
+					fprintf(stderr, "!! Invalid corruption model %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
 				break;
 			case 'c':
-				cut_rate = parse_number(optarg) % 101;
+				params.cut_rate = parse_number(optarg) % 101;
 				break;
 			case 'l':
-				loss_rate = parse_number(optarg) % 101;
+				params.loss_rate = parse_number(optarg) % 101;
 				break;
 			case 's':
 				seed = parse_number(optarg);
 				break;
+			case 'b':
+				params.rate = parse_number(optarg);
+				break;
+			case 'S':
+				schedule_path = optarg;
+				break;
+			case 'F':
+				rules_path = optarg;
+				break;
+			case 'w':
+				record_path = optarg;
+				break;
+			case 'W':
+				replay_path = optarg;
+				break;
+			case 't':
+				trace_paths[0] = optarg;
+				break;
+			case 'T':
+				trace_paths[1] = optarg;
+				break;
+			case 'q':
+				if (parse_size(optarg, &queue_capacity)) {
+					fprintf(stderr, "!! Invalid queue capacity for -q: %s\n",
+							optarg);
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'm':
+				max_pkt_len = parse_number(optarg);
+				break;
+			case 'x':
+				if (!(proto = linksim_proto_find(optarg))) {
+					fprintf(stderr, "!! Unknown protocol %s\n", optarg);
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'g':
+				use_gso = 1;
+				break;
+			case 'a':
+				pin_cpus = optarg;
+				break;
+			case 'u':
+				fifo_priority = parse_number(optarg);
+				break;
+			case 'L':
+				lock_memory = 1;
+				break;
+			case 'y':
+				busy_poll = 1;
+				busy_window = parse_number(optarg);
+				break;
+			case 'k':
+				sock_busy_poll = parse_number(optarg);
+				break;
+			case 'Q':
+				backlog_len = parse_number(optarg);
+				break;
+			case 'z':
+				use_txtime = 1;
+				break;
+			case 'B':
+				rcvbuf_len = parse_number(optarg);
+				break;
+			case 'O':
+				sndbuf_len = parse_number(optarg);
+				break;
+			case 'i':
+				pcap_in_path = optarg;
+				break;
+			case 'o':
+				pcap_out_path = optarg;
+				break;
+			case 'f':
+				config_path = optarg;
+				break;
+			case 'M':
+				links_path = optarg;
+				break;
 			case 'r':
-				link_direction = LINK_REVERSE;
+				params.link_direction = LINK_REVERSE;
 				break;
 			case 'R':
-				link_direction = LINK_BOTH_WAYS;
+				params.link_direction = LINK_BOTH_WAYS;
 				break;
 			case 'h':
 				/* Fall-through */
@@ -572,6 +2409,36 @@ int main(int argc, char **argv)
 				return EXIT_FAILURE;
 		}
 	}
+	/* The link gives the same arg to both hooks */
+	if (record_path && replay_path) {
+		fprintf(stderr, "!! Cannot record and replay decisions at once\n");
+		return EXIT_FAILURE;
+	}
+	if (max_pkt_len < proto->min_len || max_pkt_len > MAX_UDP_PAYLOAD) {
+		fprintf(stderr, "!! The max datagram size must be between %zu and "
+				"%d bytes\n", proto->min_len, MAX_UDP_PAYLOAD);
+		return EXIT_FAILURE;
+	}
+	if (!backlog_len) {
+		fprintf(stderr, "!! The send backlog must hold at least a datagram\n");
+		return EXIT_FAILURE;
+	}
+	if (!pcap_in_path != !pcap_out_path) {
+		fprintf(stderr, "!! The offline mode requires both -i and -o\n");
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* A capture, or a decision log, holds the traffic of a single link */
+	if (links_path && (pcap_in_path || record_path || replay_path)) {
+		fprintf(stderr, "!! A links file cannot be used in offline mode, "
+				"nor with a decision log\n");
+		return EXIT_FAILURE;
+	}
+	if (define_links())
+		return EXIT_FAILURE;
+	/* In offline mode, do not pay a syscall per log line */
+	if (pcap_in_path)
+		setvbuf(stderr, NULL, _IOFBF, BUFSIZ);
 	if (optind != argc) {
 		fprintf(stderr, "!! Ignoring positional arguments: ");
 		for (; optind < argc-1; ++optind)
@@ -583,19 +2450,68 @@ int main(int argc, char **argv)
 		seed = (int)time(NULL);
 		fprintf(stderr, "@@ Using random seed: %d\n", (int)seed);
 	}
-	srand((int)seed);
+	l = links;
+	p = &l->params;
 	fprintf(stderr, "@@ Using parameters:\n"
 					".. port: %d\n"
+					".. forward_host: %s\n"
 					".. forward_port: %d\n"
 					".. delay: %u\n"
 					".. jitter: %u\n"
+					".. delay_dist: %s\n"
+					".. in_order: %d\n"
 					".. err_rate: %u\n"
+					".. corruption: %s\n"
 					".. cut_rate: %u\n"
 					".. loss_rate: %u\n"
+					".. rate: %u\n"
 					".. seed: %d\n"
-					".. link_direction: %s\n",
-					port, forward_port, delay, jitter, err_rate, cut_rate,
-					loss_rate, (int)seed, get_link_direction(link_direction));
+					".. link_direction: %s\n"
+					".. queue_capacity: %zu\n"
+					".. max_size: %zu\n"
+					".. protocol: %s\n",
+					l->port, l->forward_host, l->forward_port, p->delay,
+					p->jitter,
+					dist_str(p, dist, sizeof(dist)), p->in_order,
+					p->err_rate,
+					corruption_str(p, model, sizeof(model)),
+					p->cut_rate, p->loss_rate, p->rate, (int)seed, linksim_direction_str(p->link_direction),
+					queue_capacity, max_pkt_len, proto->name);
+	if (links_path) {
+		fprintf(stderr, "@@ Serving %zu link(s) from %s:\n", nlinks,
+				links_path);
+		for (l = links; l < links + nlinks; ++l) {
+			fprintf(stderr, ".. %d -> %s [%d]: ", l->port, l->forward_host,
+					l->forward_port);
+			describe_params(&l->params);
+			fprintf(stderr, "\n");
+		}
+	}
+	/* Coalesced datagrams are received at once, the offline mode always
+	 * handles them one by one */
+	if (pcap_in_path)
+		use_gso = 0;
+	/* The offline mode does not wait, hence never spins nor paces */
+	if (pcap_in_path)
+		busy_poll = use_txtime = 0;
+#ifdef CLOCK_MONOTONIC_RAW
+	/* A clock that NTP does not slew, for steady intervals while spinning,
+	 * unless the dates are given to the kernel, which paces on
+	 * CLOCK_MONOTONIC */
+	if (busy_poll && !use_txtime)
+		clock_id = CLOCK_MONOTONIC_RAW;
+#endif
+	rx_len = use_gso ? MAX_GRO_LEN : max_pkt_len;
+	if (!(pkt_buf = malloc(rx_len > PCAP_MAX_HDR_LEN + max_pkt_len ?
+					rx_len : PCAP_MAX_HDR_LEN + max_pkt_len))) {
+		perror("Cannot allocate the packet buffer");
+		return EXIT_FAILURE;
+	}
 	/* Start proxying UDP traffic according to the specified options */
-	return proxy_traffic();
+	rval = pcap_in_path ? replay_capture(seed) : proxy_traffic(seed);
+	free(pkt_buf);
+	free(links);
+	if (link_defs)
+		config_free_links(link_defs, nlinks);
+	return rval;
 }
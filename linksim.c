@@ -0,0 +1,1167 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "linksim.h"
+
+#include <stdlib.h> /* malloc, free */
+#include <string.h> /* memcpy, memset */
+#include <stdarg.h> /* va_list */
+#include <ctype.h> /* isspace */
+#include <inttypes.h> /* PRIu64 */
+#include <math.h> /* log, log1p, floor */
+
+#include "min_queue.h" /* minq_x */
+#include "dist.h" /* dist_x */
+
+/* Random delay to add is capped to 10s */
+#define MAX_DELAY 10000
+
+/* The state of the random number generator, a xorshift64* generator.
+ * Unlike rand(), each link has its own, one per direction, so that neither
+ * links nor directions influence each other, and links can be used from
+ * different threads. */
+struct rng {
+	uint64_t s;
+};
+
+/* A delivery trace, only parsed as the link goes through it, so that long
+ * traces do not cost anything to load */
+struct trace {
+	const char *data; /* The trace, one timestamp (ms) per line, or NULL */
+	const char *end; /* The end of the trace */
+	const char *pos; /* Where to parse the next opportunity */
+	uint64_t period; /* Duration of one pass over the trace (us) */
+	uint64_t offset; /* Date of the start of the current pass (us) */
+	uint64_t at; /* Date of the current opportunity (us) */
+	size_t left; /* Bytes that can still be sent at the current one */
+};
+
+/* Packet slots allocated at once, so that the data path neither calls
+ * malloc() nor faults pages in. Several links can draw from the same one. */
+struct linksim_pool {
+	char *mem; /* The slots, contiguous, or NULL */
+	size_t count; /* How many slots there are */
+	size_t slot_len; /* The size of each slot */
+	size_t max_len; /* The largest packet that fits in a slot */
+	struct linksim_pkt **free; /* The stack of free slots */
+	size_t nfree; /* How many slots are free */
+};
+
+/* A rule, and how many packets it matched */
+struct rule {
+	const linksim_filter_t *filter;
+	struct linksim_params params;
+	uint64_t matches;
+};
+
+struct linksim {
+	/* The parameters of the link. The block is never modified once
+	 * published: updates swap in a new one, so that a packet always sees a
+	 * consistent set of parameters. */
+	const struct linksim_params *params;
+	struct linksim_params *base; /* The parameters set by the user */
+	/* The parameters of each direction, in place of those of the link, or
+	 * NULL to follow them */
+	struct linksim_params *dir_params[2];
+	struct linksim_step *steps; /* The schedule of the parameters, or NULL */
+	size_t nsteps; /* The number of steps in the schedule */
+	size_t next_step; /* Index of the next step to reach */
+	int sched_started; /* Has the first packet started the schedule yet */
+	struct timeval sched_start; /* When the schedule started */
+	struct linksim_params ramp; /* Parameters interpolated during a ramp */
+	struct timeval departure[2]; /* When the last packet queued in each
+									direction leaves */
+	struct timeval link_free[2]; /* When the link will have sent its
+									backlog, per direction */
+	struct trace trace[2]; /* The delivery traces, per direction */
+	struct rule *rules; /* Parameters for specific packets, or NULL */
+	size_t nrules; /* The number of rules */
+	int started; /* Has the first packet been pushed yet */
+	struct timeval start; /* The date of the first packet, origin of the
+							 traces */
+	struct rng rng[2]; /* The random number generators, per direction */
+	/* The inverse CDF of the delay distributions in use, by
+	 * LINKSIM_DIST_X, NULL until needed */
+	float *dist[LINKSIM_DIST_EMPIRICAL + 1];
+	/* The draw of the previous delay of each direction, for correlation */
+	uint32_t delay_rnd[2];
+	/* Queues of delayed packets, per direction, so that a direction
+	 * that cannot be sent does not hold back the other one */
+	minqueue_t *queue[2];
+	size_t queue_peak; /* Max number of packets ever queued */
+	void **expired; /* Batch of expired packets being polled */
+	void **runs; /* Expired packets of each queue, before being merged */
+	size_t expired_alloc; /* How many slots are allocated in both */
+	uint64_t next_seq; /* Sequence number of the next delayed packet */
+	struct linksim_pool *pool; /* Preallocated packets, own_pool unless
+								  shared with other links */
+	struct linksim_pool own_pool;
+	struct linksim_stats stats; /* Counters */
+	FILE *log; /* Where to log actions, or NULL */
+	const struct linksim_proto *proto; /* The protocol of the packets */
+	struct linksim_decider decider; /* Hooks on the decisions */
+};
+
+/* Seed the generator, scrambling the seed with splitmix64 so that close
+ * seeds give unrelated sequences */
+static void rng_seed(struct rng *r, uint64_t seed)
+{
+	uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	/* The state must never be 0 */
+	r->s = z ? z : 0x9e3779b97f4a7c15ULL;
+}
+
+/* @return: a random 32b number */
+static inline uint32_t rng_next(struct rng *r)
+{
+	r->s ^= r->s >> 12;
+	r->s ^= r->s << 25;
+	r->s ^= r->s >> 27;
+	return (r->s * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* @return: a random 64b number */
+static inline uint64_t rng_next64(struct rng *r)
+{
+	uint64_t hi = rng_next(r);
+	return hi << 32 | rng_next(r);
+}
+
+/* Random number between 0 and 100 */
+#define RAND_PERCENT(g) (rng_next(g) % 101)
+
+/* Log an action on a processed packet */
+#define LOG_PKT_FMT(ls, buf, len, fmt, ...) do { \
+	if ((ls)->log) linksim_log(ls, buf, len, fmt, ##__VA_ARGS__); \
+} while (0)
+#define LOG_PKT(ls, buf, len, msg) LOG_PKT_FMT(ls, buf, len, msg "\n")
+
+const char *linksim_direction_str(int x)
+{
+	switch (x) {
+		case LINK_FORWARD: return "Forward";
+		case LINK_REVERSE: return "Reverse";
+		case LINK_BOTH_WAYS: return "Both ways";
+		default: return "Unknown";
+	}
+}
+
+const char *linksim_corruption_str(int x)
+{
+	switch (x) {
+		case LINKSIM_CORRUPT_BYTE: return "byte";
+		case LINKSIM_CORRUPT_BIT: return "bit";
+		case LINKSIM_CORRUPT_BURST: return "burst";
+		case LINKSIM_CORRUPT_BER: return "ber";
+		default: return "unknown";
+	}
+}
+
+const char *linksim_dist_str(int x)
+{
+	switch (x) {
+		case LINKSIM_DIST_UNIFORM: return "uniform";
+		case LINKSIM_DIST_NORMAL: return "normal";
+		case LINKSIM_DIST_PARETO: return "pareto";
+		case LINKSIM_DIST_PARETONORMAL: return "paretonormal";
+		case LINKSIM_DIST_EMPIRICAL: return "empirical";
+		default: return "unknown";
+	}
+}
+
+void linksim_params_init(struct linksim_params *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->link_direction = LINK_FORWARD;
+	p->burst_len = 16;
+}
+
+/* @return: left > right */
+static inline int timeval_cmp(const struct timeval *left,
+							const struct timeval *right)
+{
+	return left->tv_sec == right->tv_sec ?
+		left->tv_usec > right->tv_usec :
+		left->tv_sec > right->tv_sec;
+}
+
+ /* ? a > b */
+static int pkt_cmp(const void *a, const void *b)
+{
+	const struct linksim_pkt *left = a;
+	const struct linksim_pkt *right = b;
+	/* We compare the packets based on their (future) expiration date,
+	 * then on their arrival order to deliver them FIFO on ties */
+	if (left->ts.tv_sec != right->ts.tv_sec ||
+		left->ts.tv_usec != right->ts.tv_usec)
+		return timeval_cmp(&left->ts, &right->ts);
+	return left->seq > right->seq;
+}
+
+/* @return: a slot for a packet of len bytes, from the pool if possible */
+static inline struct linksim_pkt *pkt_alloc(linksim_t *ls, size_t len)
+{
+	struct linksim_pool *pool = ls->pool;
+	if (len <= pool->max_len && pool->nfree)
+		return pool->free[--pool->nfree];
+	return malloc(sizeof(struct linksim_pkt) + len);
+}
+
+/* Give back a slot obtained from pkt_alloc() */
+static inline void pkt_release(linksim_t *ls, struct linksim_pkt *p)
+{
+	struct linksim_pool *pool = ls->pool;
+	uintptr_t addr = (uintptr_t)p, mem = (uintptr_t)pool->mem;
+	if (addr >= mem && addr < mem + pool->count * pool->slot_len)
+		pool->free[pool->nfree++] = p;
+	else
+		free(p);
+}
+
+linksim_t *linksim_new(const struct linksim_params *params, unsigned long seed)
+{
+	linksim_t *ls;
+	if (!params || !(ls = calloc(1, sizeof(*ls))))
+		return NULL;
+	if (!(ls->queue[0] = minq_new(pkt_cmp, 0)) ||
+		!(ls->queue[1] = minq_new(pkt_cmp, 0)) ||
+		linksim_set_params(ls, params)) {
+		minq_del(ls->queue[0]);
+		minq_del(ls->queue[1]);
+		free(ls);
+		return NULL;
+	}
+	rng_seed(&ls->rng[0], seed);
+	rng_seed(&ls->rng[1], ~(uint64_t)seed);
+	ls->proto = &linksim_proto_trtp;
+	ls->pool = &ls->own_pool;
+	return ls;
+}
+
+/* Tabulate the delay distribution of p if needed, so that drawing delays
+ * never allocates
+ * @return: non-zero value on error */
+static int prepare_dist(linksim_t *ls, const struct linksim_params *p)
+{
+	if (p->delay_dist < LINKSIM_DIST_UNIFORM ||
+			p->delay_dist > LINKSIM_DIST_EMPIRICAL)
+		return -1;
+	/* The empirical table comes with its histogram */
+	if (p->delay_dist == LINKSIM_DIST_UNIFORM ||
+			p->delay_dist == LINKSIM_DIST_EMPIRICAL || ls->dist[p->delay_dist])
+		return 0;
+	return !(ls->dist[p->delay_dist] = dist_table_new(p->delay_dist));
+}
+
+int linksim_set_params(linksim_t *ls, const struct linksim_params *params)
+{
+	struct linksim_params *p, *old = ls->base;
+	if (!(p = malloc(sizeof(*p))))
+		return -1;
+	if (prepare_dist(ls, params)) {
+		free(p);
+		return -1;
+	}
+	*p = *params;
+	/* Publish the new block, then retire the old one. A running schedule
+	 * keeps precedence over the base parameters. */
+	ls->base = p;
+	if (ls->params == old)
+		ls->params = p;
+	free(old);
+	return 0;
+}
+
+int linksim_set_direction_params(linksim_t *ls, int direction,
+		const struct linksim_params *params)
+{
+	struct linksim_params *p = NULL, **slot;
+	if (direction != LINK_FORWARD && direction != LINK_REVERSE)
+		return -1;
+	slot = &ls->dir_params[direction - 1];
+	if (params) {
+		if (!(p = malloc(sizeof(*p))))
+			return -1;
+		if (prepare_dist(ls, params)) {
+			free(p);
+			return -1;
+		}
+		*p = *params;
+		/* The direction is simulated, as its parameters tell */
+		p->link_direction = LINK_BOTH_WAYS;
+	}
+	free(*slot);
+	*slot = p;
+	return 0;
+}
+
+int linksim_set_schedule(linksim_t *ls, const struct linksim_step *steps,
+		size_t n)
+{
+	struct linksim_step *copy = NULL;
+	size_t i;
+	for (i = 1; i < n; ++i)
+		if (steps[i].at < steps[i - 1].at)
+			return -1;
+	for (i = 0; i < n; ++i)
+		if (prepare_dist(ls, &steps[i].params))
+			return -1;
+	if (n && !(copy = malloc(n * sizeof(*copy))))
+		return -1;
+	if (n)
+		memcpy(copy, steps, n * sizeof(*copy));
+	free(ls->steps);
+	ls->steps = copy;
+	ls->nsteps = n;
+	ls->next_step = 0;
+	ls->sched_started = 0;
+	ls->params = ls->base;
+	return 0;
+}
+
+/* Parse one line of a trace, moving pos to the next one
+ * @return: non-zero value iff the line held a valid timestamp
+ */
+static int trace_parse(const char **pos, const char *end, uint64_t *ms)
+{
+	const char *c = *pos;
+	int valid;
+	while (c < end && (*c == ' ' || *c == '\t'))
+		++c;
+	valid = c < end && *c >= '0' && *c <= '9';
+	for (*ms = 0; c < end && *c >= '0' && *c <= '9'; ++c)
+		*ms = *ms * 10 + (*c - '0');
+	/* Only trailing spaces can follow the timestamp */
+	for (; c < end && *c != '\n'; ++c)
+		if (!isspace((unsigned char)*c))
+			valid = 0;
+	*pos = c < end ? c + 1 : c;
+	return valid;
+}
+
+/* Move to the next delivery opportunity, looping over the trace */
+static void trace_next(struct trace *t)
+{
+	uint64_t ms, at;
+	do {
+		if (t->pos == t->end) {
+			t->pos = t->data;
+			t->offset += t->period;
+		}
+	} while (!trace_parse(&t->pos, t->end, &ms)); /* Skip invalid lines */
+	at = t->offset + ms * 1000;
+	/* Timestamps going backwards are read as the previous one */
+	if (at > t->at)
+		t->at = at;
+	t->left = LINKSIM_TRACE_MTU;
+}
+
+int linksim_set_trace(linksim_t *ls, int direction, const char *trace,
+		size_t len)
+{
+	struct trace *t;
+	const char *c;
+	uint64_t period;
+	if (direction != LINK_FORWARD && direction != LINK_REVERSE)
+		return -1;
+	t = &ls->trace[direction - 1];
+	if (!trace) {
+		t->data = NULL;
+		return 0;
+	}
+	/* The last timestamp is the duration of the trace, find it without
+	 * reading the whole trace */
+	for (c = trace + len; c > trace && isspace((unsigned char)c[-1]); --c);
+	for (; c > trace && c[-1] != '\n'; --c);
+	if (!trace_parse(&c, trace + len, &period) || !period)
+		return -1;
+	t->data = trace;
+	t->end = trace + len;
+	t->pos = trace;
+	t->period = period * 1000;
+	t->offset = 0;
+	t->at = 0;
+	trace_next(t);
+	return 0;
+}
+
+int linksim_set_rules(linksim_t *ls, const struct linksim_rule *rules,
+		size_t n)
+{
+	struct rule *copy = NULL;
+	size_t i;
+	for (i = 0; i < n; ++i)
+		if (prepare_dist(ls, &rules[i].params))
+			return -1;
+	if (n && !(copy = malloc(n * sizeof(*copy))))
+		return -1;
+	for (i = 0; i < n; ++i) {
+		copy[i].filter = rules[i].filter;
+		copy[i].params = rules[i].params;
+		/* The filter chooses the directions */
+		copy[i].params.link_direction = LINK_BOTH_WAYS;
+		copy[i].matches = 0;
+	}
+	free(ls->rules);
+	ls->rules = copy;
+	ls->nrules = n;
+	return 0;
+}
+
+uint64_t linksim_rule_matches(const linksim_t *ls, size_t i)
+{
+	return i < ls->nrules ? ls->rules[i].matches : 0;
+}
+
+void linksim_get_params(const linksim_t *ls, struct linksim_params *params)
+{
+	*params = *ls->params;
+}
+
+int linksim_set_delay_histogram(linksim_t *ls, const double *values,
+		const double *weights, size_t n)
+{
+	float *t;
+	if (!(t = dist_table_from_histogram(values, weights, n)))
+		return -1;
+	free(ls->dist[LINKSIM_DIST_EMPIRICAL]);
+	ls->dist[LINKSIM_DIST_EMPIRICAL] = t;
+	return 0;
+}
+
+void linksim_del(linksim_t *ls)
+{
+	struct linksim_pkt *p;
+	int i;
+	if (!ls) return;
+	for (i = 0; i < 2; ++i) {
+		while ((p = minq_peek(ls->queue[i]))) {
+			minq_pop(ls->queue[i]);
+			pkt_release(ls, p);
+		}
+		minq_del(ls->queue[i]);
+	}
+	for (i = 0; i <= LINKSIM_DIST_EMPIRICAL; ++i)
+		free(ls->dist[i]);
+	free(ls->expired);
+	free(ls->runs);
+	free(ls->own_pool.mem);
+	free(ls->own_pool.free);
+	free(ls->base);
+	free(ls->dir_params[0]);
+	free(ls->dir_params[1]);
+	free(ls->steps);
+	free(ls->rules);
+	free(ls);
+}
+
+void linksim_set_log(linksim_t *ls, FILE *log)
+{
+	ls->log = log;
+}
+
+/* Make room for a batch of n expired packets
+ * @return: non-zero value on error (the batch keeps its previous size) */
+static int grow_expired(linksim_t *ls, size_t n)
+{
+	void **tmp;
+	if (n <= ls->expired_alloc)
+		return 0;
+	if (!(tmp = realloc(ls->expired, n * sizeof(*tmp))))
+		return -1;
+	ls->expired = tmp;
+	if (!(tmp = realloc(ls->runs, n * sizeof(*tmp))))
+		return -1;
+	ls->runs = tmp;
+	ls->expired_alloc = n;
+	return 0;
+}
+
+int linksim_reserve(linksim_t *ls, size_t n)
+{
+	if (minq_reserve(ls->queue[0], n) || minq_reserve(ls->queue[1], n))
+		return -1;
+	/* Size the batch of expired packets accordingly */
+	return grow_expired(ls, 2 * n);
+}
+
+/* Allocate and touch the n slots of an empty pool
+ * @return: non-zero value on error (the pool is then still empty) */
+static int pool_fill(struct linksim_pool *pool, size_t n, size_t max_len)
+{
+	size_t i, slot_len;
+	if (!n)
+		return -1;
+	/* Keep the slots aligned as malloc() would */
+	slot_len = sizeof(struct linksim_pkt) + max_len;
+	slot_len = (slot_len + 15) & ~(size_t)15;
+	if (n > SIZE_MAX / slot_len ||
+			!(pool->free = malloc(n * sizeof(*pool->free))))
+		return -1;
+	if (!(pool->mem = malloc(n * slot_len))) {
+		free(pool->free);
+		pool->free = NULL;
+		return -1;
+	}
+	/* Touch every page now rather than on the data path */
+	memset(pool->mem, 0, n * slot_len);
+	pool->count = n;
+	pool->slot_len = slot_len;
+	pool->max_len = max_len;
+	/* Hand out the slots in address order */
+	for (i = 0; i < n; ++i)
+		pool->free[i] = (struct linksim_pkt*)(pool->mem +
+				(n - 1 - i) * slot_len);
+	pool->nfree = n;
+	return 0;
+}
+
+int linksim_prealloc(linksim_t *ls, size_t n, size_t max_len)
+{
+	if (ls->pool != &ls->own_pool || ls->own_pool.mem ||
+			pool_fill(&ls->own_pool, n, max_len))
+		return -1;
+	memset(ls->expired, 0, ls->expired_alloc * sizeof(*ls->expired));
+	memset(ls->runs, 0, ls->expired_alloc * sizeof(*ls->runs));
+	return 0;
+}
+
+linksim_pool_t *linksim_pool_new(size_t n, size_t max_len)
+{
+	linksim_pool_t *pool;
+	if (!(pool = calloc(1, sizeof(*pool))))
+		return NULL;
+	if (pool_fill(pool, n, max_len)) {
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void linksim_pool_del(linksim_pool_t *pool)
+{
+	if (!pool) return;
+	free(pool->mem);
+	free(pool->free);
+	free(pool);
+}
+
+int linksim_set_pool(linksim_t *ls, linksim_pool_t *pool)
+{
+	/* The packets of the link would go back to the wrong pool */
+	if (!pool || ls->pool != &ls->own_pool || ls->own_pool.mem)
+		return -1;
+	ls->pool = pool;
+	return 0;
+}
+
+void linksim_set_proto(linksim_t *ls, const struct linksim_proto *proto)
+{
+	ls->proto = proto;
+}
+
+void linksim_set_decider(linksim_t *ls, const struct linksim_decider *d)
+{
+	if (d)
+		ls->decider = *d;
+	else
+		memset(&ls->decider, 0, sizeof(ls->decider));
+}
+
+void linksim_log(const linksim_t *ls, const char *buf, size_t len,
+		const char *fmt, ...)
+{
+	struct linksim_hdr hdr;
+	va_list ap;
+	if (!ls->log) return;
+	ls->proto->parse(buf, len, &hdr);
+	if (hdr.has_seq)
+		fprintf(ls->log, "[%s %3" PRIu64 "] ", hdr.type, hdr.seq);
+	else
+		fprintf(ls->log, "[%s] ", hdr.type);
+	va_start(ap, fmt);
+	vfprintf(ls->log, fmt, ap);
+	va_end(ap);
+}
+
+/* @return: a + (b - a) * num / den */
+static inline unsigned int lerp(unsigned int a, unsigned int b,
+		uint64_t num, uint64_t den)
+{
+	return a <= b ? a + (unsigned int)((b - a) * num / den) :
+		a - (unsigned int)((a - b) * num / den);
+}
+
+/* Select the parameters that apply at the date now, according to the
+ * schedule. The steps are reached in order, so this is O(1) per packet. */
+static void follow_schedule(linksim_t *ls, const struct timeval *now)
+{
+	const struct linksim_params *from, *to;
+	uint64_t elapsed, t0, num, den;
+	if (!ls->sched_started) {
+		ls->sched_start = *now;
+		ls->sched_started = 1;
+	}
+	/* Elapsed time in ms, dates in the past count as the start */
+	elapsed = timeval_cmp(now, &ls->sched_start) ?
+		(uint64_t)(now->tv_sec - ls->sched_start.tv_sec) * 1000 +
+		(now->tv_usec - ls->sched_start.tv_usec) / 1000 : 0;
+	/* Move past all the steps we reached */
+	while (ls->next_step < ls->nsteps &&
+			elapsed >= ls->steps[ls->next_step].at)
+		++ls->next_step;
+	from = ls->next_step ? &ls->steps[ls->next_step - 1].params : ls->base;
+	if (ls->next_step == ls->nsteps || !ls->steps[ls->next_step].ramp) {
+		ls->params = from;
+		return;
+	}
+	/* We are ramping towards the next step */
+	to = &ls->steps[ls->next_step].params;
+	t0 = ls->next_step ? ls->steps[ls->next_step - 1].at : 0;
+	num = elapsed - t0;
+	den = ls->steps[ls->next_step].at - t0;
+	ls->ramp = *from;
+	ls->ramp.delay = lerp(from->delay, to->delay, num, den);
+	ls->ramp.jitter = lerp(from->jitter, to->jitter, num, den);
+	ls->ramp.delay_corr = lerp(from->delay_corr, to->delay_corr, num, den);
+	ls->ramp.err_rate = lerp(from->err_rate, to->err_rate, num, den);
+	ls->ramp.ber = from->ber + (to->ber - from->ber) * num / den;
+	ls->ramp.burst_len = lerp(from->burst_len, to->burst_len, num, den);
+	ls->ramp.cut_rate = lerp(from->cut_rate, to->cut_rate, num, den);
+	ls->ramp.loss_rate = lerp(from->loss_rate, to->loss_rate, num, den);
+	ls->ramp.rate = lerp(from->rate, to->rate, num, den);
+	ls->params = &ls->ramp;
+}
+
+/* Add us microseconds to a timestamp, keeping it normalized */
+static inline void timeval_add_us(struct timeval *tv, uint64_t us)
+{
+	tv->tv_sec += us / 1000000;
+	tv->tv_usec += us % 1000000;
+	if (tv->tv_usec >= 1000000) {
+		++tv->tv_sec;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+/* @return: the parameters of the first rule matched by the packet, p if
+ *          there is none */
+static inline const struct linksim_params *match_rules(linksim_t *ls,
+		const char *buf, size_t len, int direction,
+		const struct linksim_params *p)
+{
+	struct rule *r, *end = ls->rules + ls->nrules;
+	for (r = ls->rules; r < end; ++r) {
+		if (linksim_filter_match(r->filter, buf, len, direction)) {
+			++r->matches;
+			return &r->params;
+		}
+	}
+	return p;
+}
+
+/* @return: the length of the packet once cut after its header, 0 if it
+ *          cannot be cut */
+static inline size_t cut_len(const linksim_t *ls, const char *buf, size_t len)
+{
+	struct linksim_hdr hdr;
+	ls->proto->parse(buf, len, &hdr);
+	return hdr.hdr_len < len ? hdr.hdr_len : 0;
+}
+
+/* Compute when a packet of len bytes, ready to be sent at ts, has been sent
+ * by a link following the trace t. Packets are sent FIFO, each opportunity
+ * can send LINKSIM_TRACE_MTU bytes, possibly of several packets, and the
+ * packets larger than what is left span the following opportunities. */
+static void trace_send(linksim_t *ls, struct trace *t, struct timeval *ts,
+		size_t len)
+{
+	uint64_t ready = 0;
+	if (timeval_cmp(ts, &ls->start))
+		ready = (uint64_t)(ts->tv_sec - ls->start.tv_sec) * 1000000 +
+			ts->tv_usec - ls->start.tv_usec;
+	if (t->at < ready) {
+		/* The opportunities that passed while the link was idle are lost.
+		 * Skip whole passes at once after a long silence. */
+		if (ready - t->at > t->period) {
+			uint64_t skip = (ready - t->at) / t->period * t->period;
+			t->offset += skip;
+			t->at += skip;
+		}
+		while (t->at < ready)
+			trace_next(t);
+	}
+	while (len > t->left) {
+		len -= t->left;
+		trace_next(t);
+	}
+	t->left -= len;
+	*ts = ls->start;
+	timeval_add_us(ts, t->at);
+}
+
+/* @return: a random 32b number, correlated by corr % with the previous one
+ *          last, as netem does */
+static inline uint32_t rng_next_corr(struct rng *g, uint32_t *last,
+		unsigned int corr)
+{
+	uint64_t u = rng_next(g), rho;
+	if (!corr)
+		return u;
+	rho = corr >= 100 ? (uint64_t)1 << 32 : ((uint64_t)corr << 32) / 100;
+	*last = (u * (((uint64_t)1 << 32) - rho) + *last * rho) >> 32;
+	return *last;
+}
+
+/* Compute the delay (in ms) to apply to a packet. Whatever the
+ * distribution, this costs a single draw. */
+static inline unsigned int draw_delay(linksim_t *ls,
+		const struct linksim_params *p, int direction)
+{
+	const float *t = ls->dist[p->delay_dist];
+	struct rng *g = &ls->rng[direction - 1];
+	uint32_t *last = &ls->delay_rnd[direction - 1];
+	unsigned int applied_delay;
+	double d;
+	if (!p->jitter) {
+		applied_delay = p->delay;
+	} else if (t) {
+		d = p->delay + p->jitter *
+			dist_sample(t, rng_next_corr(g, last, p->delay_corr)) + .5;
+		applied_delay = d < 0 ? 0 : d >= MAX_DELAY ? MAX_DELAY - 1 :
+			(unsigned int)d;
+	} else if (p->jitter > p->delay) {
+		applied_delay = rng_next_corr(g, last, p->delay_corr) %
+			(p->delay + p->jitter);
+	} else {
+		applied_delay = (p->delay + rng_next_corr(g, last, p->delay_corr) %
+				(2 * p->jitter)) - p->jitter;
+	}
+	return applied_delay % MAX_DELAY;
+}
+
+/* Flip the i-th bit of buf, counting from the most significant bit of the
+ * first byte as on the wire */
+#define FLIP_BIT(buf, i) ((buf)[(i) / 8] ^= (char)(0x80 >> ((i) % 8)))
+
+/* From this bit error rate, flipped bits are too close to jump from one to
+ * the next, and whole words of errors are drawn at once instead */
+#define BER_DENSE (1.0 / 64)
+/* Precision of the bit error rate in dense mode (bits) */
+#define BER_DENSE_BITS 16
+
+/* @return: the number of bits set in x */
+static inline unsigned int popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	x -= (x >> 1) & 0x5555555555555555ULL;
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* @return: the number of correct bits before the next flipped one, for a
+ *          bit error rate p with log_q = log(1 - p). This is a geometric
+ *          draw, so that sparse errors cost one draw each, not one per bit. */
+static inline uint64_t ber_gap(struct rng *g, double log_q)
+{
+	/* Uniform in ]0, 1] */
+	double u = ((rng_next64(g) >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double gap = floor(log(u) / log_q);
+	return gap < 1.8e19 ? (uint64_t)gap : UINT64_MAX;
+}
+
+/* @return: a 64-bit word mask whose bits are set independently, with
+ *          probability q / 2^BER_DENSE_BITS. Starting from the least
+ *          significant bit of q, each random word either adds half of the
+ *          missing probability (OR) or halves the current one (AND). */
+static inline uint64_t ber_mask(struct rng *g, unsigned int q)
+{
+	uint64_t m = 0;
+	unsigned int i = 0;
+	if (q >> BER_DENSE_BITS)
+		return ~(uint64_t)0;
+	/* The AND of the low zero bits would keep m at 0 */
+	for (; !(q & 1); q >>= 1, ++i);
+	for (; i < BER_DENSE_BITS; q >>= 1, ++i)
+		m = (q & 1) ? m | rng_next64(g) : m & rng_next64(g);
+	return m;
+}
+
+/* Flip each bit of a packet with probability ber >= BER_DENSE, XOR-ing it
+ * with a 64-bit word mask of errors, one word at a time
+ * @return: the number of bits flipped */
+static uint64_t ber_flip_dense(struct rng *g, double ber, char *buf,
+		size_t len)
+{
+	unsigned int q = (unsigned int)(ber * (1U << BER_DENSE_BITS) + .5);
+	uint64_t m, w, n = 0;
+	size_t i;
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		m = ber_mask(g, q);
+		memcpy(&w, buf + i, sizeof(w));
+		w ^= m;
+		memcpy(buf + i, &w, sizeof(w));
+		n += popcount64(m);
+	}
+	if (i < len) {
+		m = ber_mask(g, q) & (((uint64_t)1 << (len - i) * 8) - 1);
+		n += popcount64(m);
+		for (; i < len; ++i, m >>= 8)
+			buf[i] ^= (char)m;
+	}
+	return n;
+}
+
+/* @return: whether a packet of len bytes gets at least one bit flipped in
+ *          BER mode, by the errors drawn from seed */
+static int ber_hits(double ber, uint64_t seed, size_t len)
+{
+	struct rng g;
+	if (ber >= BER_DENSE)
+		return 1;
+	rng_seed(&g, seed);
+	return ber_gap(&g, log1p(-ber)) < (uint64_t)len * 8;
+}
+
+/* Flip the bits of a packet according to the corruption model of p,
+ * drawing the errors from seed
+ * @return: the number of bits flipped */
+static uint64_t flip_bits(const struct linksim_params *p, uint64_t seed,
+		char *buf, size_t len)
+{
+	uint64_t bits = (uint64_t)len * 8, n = 0, pos, gap, blen, word = 0;
+	double log_q;
+	struct rng g;
+	rng_seed(&g, seed);
+	switch (p->corruption) {
+		case LINKSIM_CORRUPT_BIT:
+			FLIP_BIT(buf, rng_next64(&g) % bits);
+			return 1;
+		case LINKSIM_CORRUPT_BURST:
+			blen = p->burst_len ? p->burst_len : 1;
+			if (blen > bits)
+				blen = bits;
+			pos = rng_next64(&g) % (bits - blen + 1);
+			for (gap = 0; gap < blen; ++gap) {
+				if (!(gap % 64))
+					word = rng_next64(&g);
+				if (!gap || gap == blen - 1 || ((word >> gap % 64) & 1)) {
+					FLIP_BIT(buf, pos + gap);
+					++n;
+				}
+			}
+			return n;
+		case LINKSIM_CORRUPT_BER:
+			if (p->ber >= BER_DENSE)
+				return ber_flip_dense(&g, p->ber, buf, len);
+			log_q = log1p(-p->ber);
+			for (pos = 0; (gap = ber_gap(&g, log_q)) < bits - pos;
+					pos += gap + 1) {
+				FLIP_BIT(buf, pos + gap);
+				++n;
+			}
+			return n;
+		default:
+			return 0;
+	}
+}
+
+/* Queue a packet until its expiration date ts */
+static int enqueue(linksim_t *ls, const char *buf, size_t len, int direction,
+		const struct timeval *ts)
+{
+	struct linksim_pkt *slot;
+	/* Create a slot for the packet queue, just large enough for it */
+	if (!(slot = pkt_alloc(ls, len)))
+		return LINKSIM_ERROR;
+	slot->direction = direction;
+	/* Copy the packet in the slot */
+	memcpy(slot->buf, buf, len);
+	slot->size = len;
+	slot->seq = ls->next_seq++;
+	slot->ts = *ts;
+	/* Enqueue the new slot */
+	if (minq_push(ls->queue[direction - 1], slot)) {
+		pkt_release(ls, slot);
+		return LINKSIM_ERROR;
+	}
+	if (minq_size(ls->queue[0]) + minq_size(ls->queue[1]) > ls->queue_peak)
+		ls->queue_peak = minq_size(ls->queue[0]) + minq_size(ls->queue[1]);
+	++ls->stats.delayed;
+	return LINKSIM_QUEUED;
+}
+
+/* Decide what to do with a packet, according to the parameters p */
+static void decide(linksim_t *ls, const struct linksim_params *p,
+		int direction, const char *buf, size_t len,
+		struct linksim_decision *d)
+{
+	struct rng *g = &ls->rng[direction - 1];
+	d->flags = 0;
+	/* Do we drop it? */
+	if (p->loss_rate && RAND_PERCENT(g) < p->loss_rate) {
+		d->flags = LINKSIM_DEC_DROP;
+		return;
+	}
+	/* Do we cut it after the header? (only if packet is elligible) */
+	if (p->cut_rate && RAND_PERCENT(g) < p->cut_rate &&
+			(d->cut_len = cut_len(ls, buf, len))) {
+		d->flags |= LINKSIM_DEC_CUT;
+	/* or do we corrupt it? */
+	} else if (p->corruption == LINKSIM_CORRUPT_BER) {
+		if (p->ber > 0 && len) {
+			d->flip_seed = rng_next64(g);
+			if (ber_hits(p->ber, d->flip_seed, len))
+				d->flags |= LINKSIM_DEC_FLIP;
+		}
+	} else if (p->err_rate && RAND_PERCENT(g) < p->err_rate && len) {
+		if (p->corruption == LINKSIM_CORRUPT_BYTE) {
+			d->flags |= LINKSIM_DEC_CORRUPT;
+			d->corrupt_idx = rng_next(g) % len;
+		} else {
+			d->flags |= LINKSIM_DEC_FLIP;
+			d->flip_seed = rng_next64(g);
+		}
+	}
+	/* Do we delay it? */
+	if (p->delay) {
+		d->flags |= LINKSIM_DEC_DELAY;
+		d->delay = draw_delay(ls, p, direction);
+	}
+}
+
+/* Submit a packet to the link, see linksim_push()
+ * @date: Where to give the departure date of a delayed packet instead of
+ *        queueing it, or NULL to queue it */
+static int push(linksim_t *ls, char *buf, size_t *len, int direction,
+		const struct timeval *now, struct timeval *date)
+{
+	const struct linksim_params *p;
+	struct linksim_decision d;
+	struct trace *trace;
+	++ls->stats.received;
+	if (!ls->started) {
+		ls->start = *now;
+		ls->started = 1;
+	}
+	if (ls->steps)
+		follow_schedule(ls, now);
+	/* A direction with its own parameters does not follow the link */
+	p = ls->dir_params[direction - 1] ? ls->dir_params[direction - 1] :
+		ls->params;
+	if (ls->nrules)
+		p = match_rules(ls, buf, *len, direction, p);
+	trace = &ls->trace[direction - 1];
+	/* Simply relay packets in the directions that are not simulated */
+	if (!SAME_DIRECTION(direction, p->link_direction))
+		return LINKSIM_FORWARD;
+	/* Decide, unless the decision is imposed, then apply the decision */
+	if (!ls->decider.replay ||
+			!ls->decider.replay(ls->decider.arg, buf, *len, direction, &d))
+		decide(ls, p, direction, buf, *len, &d);
+	if (ls->decider.record)
+		ls->decider.record(ls->decider.arg, buf, *len, direction, &d);
+	if (d.flags & LINKSIM_DEC_DROP) {
+		LOG_PKT(ls, buf, *len, "Dropping packet");
+		++ls->stats.dropped;
+		return LINKSIM_DROPPED;
+	}
+	if ((d.flags & LINKSIM_DEC_CUT) && d.cut_len < *len) {
+		LOG_PKT(ls, buf, *len, "Truncating packet");
+		/* ... and don't forget to mark it as truncated */
+		if (ls->proto->truncate)
+			ls->proto->truncate(buf, *len);
+		*len = d.cut_len;
+		++ls->stats.cut;
+	} else if ((d.flags & LINKSIM_DEC_CORRUPT) && d.corrupt_idx < *len) {
+		LOG_PKT_FMT(ls, buf, *len, "Corrupting packet: inverted byte #%zu\n",
+				d.corrupt_idx);
+		buf[d.corrupt_idx] = ~buf[d.corrupt_idx];
+		++ls->stats.corrupted;
+	} else if ((d.flags & LINKSIM_DEC_FLIP) && *len) {
+		uint64_t n;
+		/* Describe the packet before it is corrupted */
+		LOG_PKT_FMT(ls, buf, *len, "Corrupting packet: ");
+		n = flip_bits(p, d.flip_seed, buf, *len);
+		if (ls->log)
+			fprintf(ls->log, "flipped %" PRIu64 " bit(s)\n", n);
+		if (n) {
+			++ls->stats.corrupted;
+			ls->stats.flipped += n;
+		}
+	}
+	/* Do we want to simulate delay or a limited bandwidth, or must the
+	 * packet wait for the previous ones? */
+	if ((d.flags & LINKSIM_DEC_DELAY) || p->rate || trace->data ||
+			(p->in_order &&
+			 timeval_cmp(&ls->departure[direction - 1], now))) {
+		struct timeval ts = *now, *last = &ls->departure[direction - 1];
+		if (trace->data) {
+			/* The packet leaves at the opportunities given by the trace */
+			trace_send(ls, trace, &ts, *len);
+		} else if (p->rate) {
+			/* The packet is sent once the link has sent the previous ones */
+			struct timeval *link_free = &ls->link_free[direction - 1];
+			if (timeval_cmp(link_free, &ts))
+				ts = *link_free;
+			/* Transmission time: bits / (kbit/s) = ms */
+			timeval_add_us(&ts, (uint64_t)*len * 8000 / p->rate);
+			*link_free = ts;
+		}
+		if (d.flags & LINKSIM_DEC_DELAY) {
+			LOG_PKT_FMT(ls, buf, *len, "Delayed packet by %u ms\n", d.delay);
+			/* delay is in ms not us! */
+			timeval_add_us(&ts, (uint64_t)d.delay * 1000);
+		}
+		/* Leave right after the previous packet rather than overtake it.
+		 * The packets are then queued by increasing date, which the queue
+		 * inserts in O(1). */
+		if (timeval_cmp(last, &ts)) {
+			if (p->in_order)
+				ts = *last;
+		} else {
+			*last = ts;
+		}
+		if (!date)
+			return enqueue(ls, buf, *len, direction, &ts);
+		*date = ts;
+		++ls->stats.delayed;
+		return LINKSIM_DATED;
+	}
+	/* Forward it to the host we're proxying */
+	return LINKSIM_FORWARD;
+}
+
+int linksim_push(linksim_t *ls, char *buf, size_t *len, int direction,
+		const struct timeval *now)
+{
+	return push(ls, buf, len, direction, now, NULL);
+}
+
+int linksim_push_dated(linksim_t *ls, char *buf, size_t *len,
+		int direction, const struct timeval *now, struct timeval *date)
+{
+	return push(ls, buf, len, direction, now, date);
+}
+
+/* Make sure that a whole burst of expiries fits in a single batch. On
+ * failure, deliver what we can, the rest will follow. */
+static inline void fit_expired(linksim_t *ls)
+{
+	if (ls->expired_alloc < minq_size(ls->queue[0]) +
+			minq_size(ls->queue[1]))
+		grow_expired(ls, minq_capacity(ls->queue[0]) +
+				minq_capacity(ls->queue[1]));
+}
+
+size_t linksim_poll(linksim_t *ls, const struct timeval *now,
+		struct linksim_pkt ***pkts)
+{
+	struct linksim_pkt key; /* Only its timestamp is used */
+	void **fwd, **rev, **end_fwd, **end_rev, **out;
+	size_t n;
+	fit_expired(ls);
+	/* Extract all packets whose timestamp is < current time */
+	key.ts = *now;
+	key.seq = 0;
+	n = minq_pop_until(ls->queue[0], &key, ls->runs, ls->expired_alloc);
+	fwd = ls->runs;
+	end_fwd = rev = ls->runs + n;
+	n += minq_pop_until(ls->queue[1], &key, rev, ls->expired_alloc - n);
+	end_rev = ls->runs + n;
+	/* Merge both directions by expiration date */
+	for (out = ls->expired; fwd < end_fwd && rev < end_rev; ++out)
+		*out = pkt_cmp(*fwd, *rev) ? *rev++ : *fwd++;
+	while (fwd < end_fwd)
+		*out++ = *fwd++;
+	while (rev < end_rev)
+		*out++ = *rev++;
+	*pkts = (struct linksim_pkt**)ls->expired;
+	return n;
+}
+
+size_t linksim_poll_direction(linksim_t *ls, int direction,
+		const struct timeval *now, struct linksim_pkt ***pkts)
+{
+	struct linksim_pkt key; /* Only its timestamp is used */
+	fit_expired(ls);
+	key.ts = *now;
+	key.seq = 0;
+	*pkts = (struct linksim_pkt**)ls->expired;
+	return minq_pop_until(ls->queue[direction - 1], &key, ls->expired,
+			ls->expired_alloc);
+}
+
+int linksim_requeue(linksim_t *ls, struct linksim_pkt **pkts, size_t n)
+{
+	size_t i, j;
+	/* Put back each run of packets in the queue of its direction */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && pkts[j]->direction == pkts[i]->direction;
+				++j);
+		if (minq_push_bulk(ls->queue[pkts[i]->direction - 1],
+					(void**)pkts + i, j - i))
+			return -1;
+	}
+	return 0;
+}
+
+void linksim_pkt_free(linksim_t *ls, struct linksim_pkt *p)
+{
+	pkt_release(ls, p);
+}
+
+int linksim_next_deadline(const linksim_t *ls, struct timeval *deadline)
+{
+	const struct linksim_pkt *fwd = minq_peek(ls->queue[0]),
+		  *rev = minq_peek(ls->queue[1]);
+	if (!fwd && !rev) return -1;
+	*deadline = !rev || (fwd && !pkt_cmp(fwd, rev)) ? fwd->ts : rev->ts;
+	return 0;
+}
+
+int linksim_next_deadline_direction(const linksim_t *ls, int direction,
+		struct timeval *deadline)
+{
+	const struct linksim_pkt *p = minq_peek(ls->queue[direction - 1]);
+	if (!p) return -1;
+	*deadline = p->ts;
+	return 0;
+}
+
+void linksim_get_stats(const linksim_t *ls, struct linksim_stats *st)
+{
+	*st = ls->stats;
+	st->queued = minq_size(ls->queue[0]) + minq_size(ls->queue[1]);
+	st->queue_peak = ls->queue_peak;
+	st->queue_capacity = minq_capacity(ls->queue[0]) +
+		minq_capacity(ls->queue[1]);
+}
@@ -0,0 +1,421 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef __LINKSIM_H_
+#define __LINKSIM_H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+#include <stdio.h> /* FILE */
+#include <sys/time.h> /* timeval */
+
+/* The link simulation engine, usable in-process.
+ *
+ * A link instance holds the simulation parameters, its own random number
+ * generator and a queue of delayed packets. It does not perform any I/O:
+ * packets are submitted with linksim_push(), which tells what to do with
+ * them, and delayed packets are later retrieved with linksim_poll(), once
+ * the clock given by the caller has reached their expiration date.
+ * Instances are independent, hence multiple links can be used at once.
+ */
+
+/* Max packet length in the protocol (packet with max header size +
+ * max payload size + CRC2 size). The link itself accepts packets of any
+ * size. */
+#define LINKSIM_MAX_PKT_LEN (10 + 2 + 512 + 4)
+
+/* Link directions */
+#define LINK_FORWARD 1
+#define LINK_REVERSE 2
+#define LINK_BOTH_WAYS (LINK_FORWARD | LINK_REVERSE)
+#define SAME_DIRECTION(x, y) (x & y)
+
+/* Human-readable name of a direction */
+const char *linksim_direction_str(int direction);
+
+/* How the link corrupts packets */
+#define LINKSIM_CORRUPT_BYTE 0 /* Invert one random byte, at err_rate */
+#define LINKSIM_CORRUPT_BIT 1 /* Flip one random bit, at err_rate */
+#define LINKSIM_CORRUPT_BURST 2 /* Corrupt burst_len consecutive bits, at
+								   err_rate: the first and last ones are
+								   flipped, the others with probability 1/2 */
+#define LINKSIM_CORRUPT_BER 3 /* Flip each bit independently, with probability
+								 ber. err_rate is not used. */
+
+/* Human-readable name of a corruption model */
+const char *linksim_corruption_str(int corruption);
+
+/* How the delay of the packets varies around its mean */
+#define LINKSIM_DIST_UNIFORM 0 /* Uniform within delay +- jitter, or within
+								  [0, delay + jitter[ if jitter > delay */
+#define LINKSIM_DIST_NORMAL 1 /* Normal, of standard deviation jitter */
+#define LINKSIM_DIST_PARETO 2 /* Pareto, whose long tail holds the late
+								 packets, of standard deviation jitter */
+#define LINKSIM_DIST_PARETONORMAL 3 /* A quarter of normal and three quarters
+									   of Pareto, as netem */
+#define LINKSIM_DIST_EMPIRICAL 4 /* The shape of the histogram given to
+									linksim_set_delay_histogram(), moved to
+									mean delay and scaled to standard
+									deviation jitter */
+
+/* Human-readable name of a delay distribution */
+const char *linksim_dist_str(int dist);
+
+/* The parameters of the simulated link */
+struct linksim_params {
+	unsigned int delay; /* Delay applied to the packets (ms) */
+	unsigned int jitter; /* Variation of the delay (ms) */
+	int delay_dist; /* How the delay varies, one of LINKSIM_DIST_X */
+	unsigned int delay_corr; /* Correlation of the delay of a packet with
+								that of the previous one (%) */
+	unsigned int err_rate; /* Corruption rate (packet/100) */
+	int corruption; /* How packets are corrupted, one of LINKSIM_CORRUPT_X */
+	double ber; /* Bit error rate, in LINKSIM_CORRUPT_BER mode */
+	unsigned int burst_len; /* Length of the bursts of errors (bits) */
+	unsigned int cut_rate; /* Truncation rate (packet/100) */
+	unsigned int loss_rate; /* Loss rate (packet/100) */
+	unsigned int rate; /* Bandwidth of the link (kbit/s), 0 if unlimited */
+	int in_order; /* Never let a packet leave before the previous ones of
+					 its direction, whatever their delays, as a single
+					 queue would */
+	int link_direction; /* Which direction(s) suffer from the link */
+};
+
+/* Set the default parameters: a perfect link in the forward direction,
+ * corrupting bytes, or bursts of 16 bits, with uniform jitter */
+void linksim_params_init(struct linksim_params*);
+
+typedef struct linksim linksim_t;
+
+/* A packet delayed by the link */
+struct linksim_pkt {
+	struct timeval ts; /* Expiration date */
+	uint64_t seq; /* Order of arrival, to break ties on ts */
+	int direction; /* The direction of the packet */
+	size_t size; /* The length of the packet */
+	char buf[]; /* The packet data, allocated to its length */
+};
+
+/* Some statistics about a link */
+struct linksim_stats {
+	uint64_t received; /* Packets submitted to the link */
+	uint64_t dropped; /* Packets lost */
+	uint64_t cut; /* Packets truncated */
+	uint64_t corrupted; /* Packets corrupted */
+	uint64_t flipped; /* Bits flipped, by the bit-level corruption models */
+	uint64_t delayed; /* Packets queued until their expiration date */
+	size_t queued; /* Packets currently queued */
+	size_t queue_peak; /* Max number of packets ever queued */
+	size_t queue_capacity; /* Slots currently allocated for the queue */
+};
+
+/* Create a new link
+ * @params: The parameters of the link, copied
+ * @seed: The seed of the random number generators of the link
+ * @return: NULL on error
+ */
+linksim_t *linksim_new(const struct linksim_params *params, unsigned long seed);
+/* Destroy a link, and all packets it still holds */
+void linksim_del(linksim_t*);
+/* Change the parameters of the link. They apply to the packets pushed
+ * afterwards, the packets already queued keep their expiration date.
+ * Must be called from the thread using the link.
+ * @return: non-zero value on error (the link is then untouched)
+ */
+int linksim_set_params(linksim_t*, const struct linksim_params *params);
+/* Get the current parameters of the link */
+void linksim_get_params(const linksim_t*, struct linksim_params *params);
+/* Give a direction its own parameters, e.g. for an asymmetric link. They
+ * replace those of the link, and its schedule, in that direction, which is
+ * then simulated whatever their link_direction. Rules still apply first.
+ * Each direction draws from its own random number generator, so that the
+ * traffic of one direction does not change what happens to the other one.
+ * @direction: LINK_FORWARD or LINK_REVERSE
+ * @params: The parameters of the direction, copied. NULL to follow those of
+ *          the link again.
+ * @return: non-zero value on error (the link is then untouched)
+ */
+int linksim_set_direction_params(linksim_t*, int direction,
+		const struct linksim_params *params);
+/* Give the shape of the LINKSIM_DIST_EMPIRICAL delay distribution, from a
+ * histogram of measured delays. Until it is given, that distribution
+ * draws uniform delays.
+ * @values: The measured delays, in any unit and order
+ * @weights: How often each delay has been measured
+ * @n: The number of delays
+ * @return: non-zero value on error (the link is then untouched)
+ */
+int linksim_set_delay_histogram(linksim_t*, const double *values,
+		const double *weights, size_t n);
+/* One step of a schedule: the parameters that apply from a given date */
+struct linksim_step {
+	unsigned long at; /* When the step is reached (ms since the start) */
+	int ramp; /* Move linearly from the previous step to this one, instead
+				 of switching when reaching it */
+	struct linksim_params params; /* The parameters to apply */
+};
+
+/* Make the parameters of the link vary over time. The schedule starts with
+ * the first packet pushed afterwards, the parameters set by
+ * linksim_set_params() apply until the first step is reached. Numeric
+ * parameters can be ramped, the direction changes when the step is reached.
+ * @steps: The steps, by increasing date, copied. NULL to remove the schedule
+ * @n: The number of steps
+ * @return: non-zero value on error (the link is then untouched)
+ */
+int linksim_set_schedule(linksim_t*, const struct linksim_step *steps,
+		size_t n);
+/* Bytes that can be sent at each delivery opportunity of a trace */
+#define LINKSIM_TRACE_MTU 1504
+
+/* Make the capacity of the link follow a delivery trace, in the format of
+ * Mahimahi: each line holds the date (in ms) of an opportunity to send
+ * LINKSIM_TRACE_MTU bytes, and the trace loops once its last date is
+ * reached. Opportunities not used when they occur are lost. The trace starts
+ * with the first packet of the link, replaces its rate in that direction,
+ * and the delay is applied once the packets have been sent.
+ * The trace is parsed as the link goes through it, thus is not copied: it
+ * must stay valid until the link is destroyed or the trace removed, e.g.
+ * a mapping of the trace file.
+ * @direction: LINK_FORWARD or LINK_REVERSE
+ * @trace: The content of the trace, NULL to remove it
+ * @len: The length of the trace
+ * @return: non-zero value on error (the link is then untouched)
+ */
+int linksim_set_trace(linksim_t*, int direction, const char *trace,
+		size_t len);
+/* What a protocol decoder tells about a packet */
+struct linksim_hdr {
+	const char *type; /* The type of the packet, for the log */
+	int has_seq; /* Does the packet carry a readable sequence number */
+	uint64_t seq; /* Its sequence number */
+	size_t hdr_len; /* The length of its header, 0 if it cannot be cut */
+};
+
+/* How the link understands the packets of a protocol: to describe them in
+ * its log, and to cut them after their header */
+struct linksim_proto {
+	const char *name; /* The name of the protocol */
+	size_t min_len; /* Shorter packets are malformed */
+	/* Decode the header of a packet of len bytes */
+	void (*parse)(const char *buf, size_t len, struct linksim_hdr *hdr);
+	/* Mark a packet as cut after its header, NULL if there is nothing to
+	 * mark. len is the length of the packet before it was cut. */
+	void (*truncate)(char *buf, size_t len);
+};
+
+/* The built-in decoders */
+/* The protocol of the LINGI1341 project, the default */
+extern const struct linksim_proto linksim_proto_trtp;
+/* Opaque UDP payloads, which are never cut */
+extern const struct linksim_proto linksim_proto_raw;
+/* QUIC, whose long header packets can be cut before their packet number */
+extern const struct linksim_proto linksim_proto_quic;
+/* Find a built-in decoder by its name
+ * @return: NULL if there is none
+ */
+const struct linksim_proto *linksim_proto_find(const char *name);
+/* Select the protocol of the packets pushed on the link */
+void linksim_set_proto(linksim_t*, const struct linksim_proto *proto);
+
+/* A filter, matching packets on their header, length and direction.
+ *
+ * Filters are compiled from expressions such as
+ *
+ *   dir == reverse && byte[0] >> 6 == 2
+ *
+ * where a value is a number, len (the length of the packet), dir (its
+ * direction, forward or reverse), or byte[i], u16[i] or u32[i], the
+ * big-endian field at offset i in the packet, optionally masked with
+ * '& mask' or shifted with '>> n'. Values are compared with ==, !=, <, <=,
+ * > or >=, a value alone is true if it is not 0. Conditions are combined
+ * with && (and), || (or), ! (not) and parentheses. A field beyond the end
+ * of the packet makes the whole filter fail to match.
+ */
+typedef struct linksim_filter linksim_filter_t;
+
+/* Compile a filter expression
+ * @err: Where to describe the error, if any
+ * @err_len: The size of err
+ * @return: NULL on error
+ */
+linksim_filter_t *linksim_filter_compile(const char *expr, char *err,
+		size_t err_len);
+/* Release a compiled filter */
+void linksim_filter_del(linksim_filter_t*);
+/* @return: whether a packet of len bytes, in direction, matches the filter */
+int linksim_filter_match(const linksim_filter_t*, const char *buf,
+		size_t len, int direction);
+
+/* A rule, giving its own parameters to the packets matching a filter */
+struct linksim_rule {
+	const linksim_filter_t *filter; /* Which packets the rule applies to */
+	struct linksim_params params; /* What the link does to them, in both
+									 directions */
+};
+
+/* Give their own parameters to some packets. Each packet gets the
+ * parameters of the first rule it matches, those of the link otherwise.
+ * @rules: The rules, copied. The filters are not copied, and must stay
+ *         valid until the link is destroyed or the rules changed.
+ *         NULL to remove the rules.
+ * @n: The number of rules
+ * @return: non-zero value on error (the link is then untouched)
+ */
+int linksim_set_rules(linksim_t*, const struct linksim_rule *rules, size_t n);
+/* @return: how many packets matched the i-th rule */
+uint64_t linksim_rule_matches(const linksim_t*, size_t i);
+
+/* What the link decided to do with a packet */
+#define LINKSIM_DEC_DROP 0x1 /* Drop it */
+#define LINKSIM_DEC_CUT 0x2 /* Cut it to cut_len bytes */
+#define LINKSIM_DEC_CORRUPT 0x4 /* Invert its byte at corrupt_idx */
+#define LINKSIM_DEC_DELAY 0x8 /* Delay it by delay ms */
+#define LINKSIM_DEC_FLIP 0x10 /* Flip its bits, following the corruption model
+								 of the link, drawn from flip_seed */
+struct linksim_decision {
+	int flags; /* A combination of LINKSIM_DEC_X, 0 to let it through */
+	size_t cut_len; /* The length of the packet once cut */
+	size_t corrupt_idx; /* The index of the corrupted byte */
+	uint64_t flip_seed; /* The seed of the bits to flip */
+	unsigned int delay; /* The delay of the packet (ms) */
+};
+
+/* Hooks on the decisions taken on the packets in the simulated directions,
+ * to record them and to replay them later, whatever the order in which the
+ * packets then arrive. The bandwidth and traces are not part of the
+ * decisions, as they depend on the arrival dates. Bit flips are recorded as
+ * the seed they are drawn from, and must be replayed with the same
+ * corruption model. */
+struct linksim_decider {
+	/* Called with the decision taken for each packet, before it is applied
+	 * to buf, NULL not to record them */
+	void (*record)(void *arg, const char *buf, size_t len, int direction,
+			const struct linksim_decision *d);
+	/* Called before deciding what to do with a packet, NULL to always let
+	 * the link decide.
+	 * @return: non-zero value iff d has been set, and must be applied */
+	int (*replay)(void *arg, const char *buf, size_t len, int direction,
+			struct linksim_decision *d);
+	void *arg; /* Passed to the hooks */
+};
+/* Install hooks on the decisions, copied. NULL to remove them. */
+void linksim_set_decider(linksim_t*, const struct linksim_decider *d);
+
+/* Where to log the actions of the link, NULL (the default) to be quiet */
+void linksim_set_log(linksim_t*, FILE *log);
+/* Pre-size the queues of delayed packets to hold n of them per direction
+ * @return: non-zero value on error
+ */
+int linksim_reserve(linksim_t*, size_t n);
+/* Preallocate n packet slots holding up to max_len bytes each, and touch
+ * them, so that delaying a packet does not call malloc() nor fault pages
+ * in. Larger packets, or packets beyond n, are still allocated on demand.
+ * Can only be called once.
+ * @return: non-zero value on error
+ */
+int linksim_prealloc(linksim_t*, size_t n, size_t max_len);
+
+/* Packet slots shared by several links, e.g. those served by one process,
+ * so that the memory follows the packets in flight rather than the number
+ * of links */
+typedef struct linksim_pool linksim_pool_t;
+/* Preallocate and touch n packet slots holding up to max_len bytes each
+ * @return: NULL on error
+ */
+linksim_pool_t *linksim_pool_new(size_t n, size_t max_len);
+/* Release a pool, once all the links drawing from it have been deleted */
+void linksim_pool_del(linksim_pool_t*);
+/* Make the link draw its packets from a shared pool instead of its own,
+ * which must not have been preallocated. Can only be called once.
+ * @return: non-zero value on error
+ */
+int linksim_set_pool(linksim_t*, linksim_pool_t*);
+
+/* Outcome of linksim_push() */
+#define LINKSIM_ERROR -1 /* Internal error, check errno */
+#define LINKSIM_DROPPED 0 /* The packet has been lost */
+#define LINKSIM_FORWARD 1 /* The packet must be sent right away */
+#define LINKSIM_QUEUED 2 /* The packet is delayed, see linksim_poll() */
+#define LINKSIM_DATED 3 /* The packet must leave at the date given by
+						   linksim_push_dated() */
+
+/* Submit a packet to the link
+ * @buf: The packet, possibly altered in-place by the link
+ * @len: Its length, updated if the packet was truncated
+ * @direction: The direction of the packet (LINK_FORWARD or LINK_REVERSE)
+ * @now: The current date
+ * @return: One of LINKSIM_X
+ */
+int linksim_push(linksim_t*, char *buf, size_t *len, int direction,
+		const struct timeval *now);
+/* Submit a packet to the link, like linksim_push(), but give the date at
+ * which a delayed packet must leave instead of queueing it, for the caller
+ * to hand it to a scheduler of its own, e.g. the qdisc of the kernel
+ * (SO_TXTIME)
+ * @date: Set to the departure date when LINKSIM_DATED is returned
+ * @return: One of LINKSIM_X, but never LINKSIM_QUEUED
+ */
+int linksim_push_dated(linksim_t*, char *buf, size_t *len, int direction,
+		const struct timeval *now, struct timeval *date);
+/* Dequeue all delayed packets whose expiration date is before now
+ * @pkts: Set to the array of due packets, by increasing expiration date.
+ *        The array belongs to the link and is valid until the next call.
+ *        Each packet must be given back with linksim_pkt_free() or
+ *        linksim_requeue().
+ * @return: The number of due packets
+ */
+size_t linksim_poll(linksim_t*, const struct timeval *now,
+		struct linksim_pkt ***pkts);
+/* Likewise, for the packets of a single direction. Each direction has its
+ * own queue, so that the packets of one direction can be held back, e.g.
+ * until its host can receive them, without delaying the other one. */
+size_t linksim_poll_direction(linksim_t*, int direction,
+		const struct timeval *now, struct linksim_pkt ***pkts);
+/* Put back n packets obtained from linksim_poll() in the queue, e.g.
+ * because they could not be sent yet
+ * @return: non-zero value on error
+ */
+int linksim_requeue(linksim_t*, struct linksim_pkt **pkts, size_t n);
+/* Release a packet obtained from linksim_poll() */
+void linksim_pkt_free(linksim_t*, struct linksim_pkt*);
+/* Get the expiration date of the next delayed packet
+ * @return: non-zero value if no packet is queued
+ */
+int linksim_next_deadline(const linksim_t*, struct timeval *deadline);
+/* Likewise, for the packets of a single direction */
+int linksim_next_deadline_direction(const linksim_t*, int direction,
+		struct timeval *deadline);
+/* Get the statistics of the link */
+void linksim_get_stats(const linksim_t*, struct linksim_stats*);
+
+/* Log an action on a packet of len bytes, prefixed by its description */
+void linksim_log(const linksim_t*, const char *buf, size_t len,
+		const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 4, 5)))
+#endif
+	;
+
+#endif
@@ -26,9 +26,18 @@ SOFTWARE.
 
 #include <stdlib.h> /* malloc */
 #include <string.h> /* memcpy */
+#include <stdint.h> /* SIZE_MAX */
 
-/* How many item slots per allocation steps */
-#define SLOTS_PER_MALLOC 20
+/* Minimal number of item slots allocated */
+#define MIN_SLOTS 20
+
+/* The array grows geometrically (doubling its size), making the amortized
+ * cost of a push O(1) even when the queue holds millions of items.
+ * It shrinks by halves once it is at most a quarter full: the gap between
+ * the two thresholds prevents alternating push/pop around a boundary from
+ * triggering a realloc storm.
+ */
+#define SHRINK_THRESHOLD(alloc) ((alloc) >> 2)
 
 /* We use a heap to store all items,
  * this enables us to store it as a complete binary tree where each node
@@ -53,22 +62,44 @@ struct minqueue {
 	minq_key_cmp cmp; /* Compare function for the elements */
 	size_t size; /* The number of items in the queue */
 	size_t alloc; /* The number of allocated slots */
+	size_t min_alloc; /* Never shrink below that number of slots */
+	size_t peak; /* The maximal number of items ever in the queue */
 	void **e; /* The array of slots in the queue */
 };
 
-minqueue_t *minq_new(minq_key_cmp cmp)
+/* Resize the array of slots to hold n items
+ * @return: non-zero value on error (queue is then untouched)
+ */
+static int resize(minqueue_t *q, size_t n)
+{
+	void **tmp;
+	if (n > SIZE_MAX / sizeof(*q->e))
+		return -1;
+	/* If we fail, we do not want to lose the previous array of elements */
+	if (!(tmp = realloc(q->e, n * sizeof(*q->e))))
+		return -1;
+	q->e = tmp;
+	q->alloc = n;
+	return 0;
+}
+
+minqueue_t *minq_new(minq_key_cmp cmp, size_t capacity)
 {
 	minqueue_t *q;
 	if (!cmp || !(q = malloc(sizeof(*q))))
 		return NULL;
+	if (capacity < MIN_SLOTS)
+		capacity = MIN_SLOTS;
 	/* Allocate multiple elements at once to reduce the calls to realloc */
-	if (!(q->e = malloc(SLOTS_PER_MALLOC * sizeof(*q->e)))) {
+	q->e = NULL;
+	if (resize(q, capacity)) {
 		free(q);
 		return NULL;
 	}
 	q->cmp = cmp;
 	q->size = 0;
-	q->alloc = SLOTS_PER_MALLOC;
+	q->peak = 0;
+	q->min_alloc = capacity;
 	return q;
 }
 
@@ -79,24 +110,27 @@ void minq_del(minqueue_t *q)
 	free(q);
 }
 
+int minq_reserve(minqueue_t *q, size_t n)
+{
+	if (!q) return -1;
+	if (n > q->alloc && resize(q, n))
+		return -1;
+	if (n > q->min_alloc)
+		q->min_alloc = n;
+	return 0;
+}
+
 int minq_push(minqueue_t* q, void *v)
 {
 	if (!q) return -1;
-	/* Check if we have enough mem. slots */
-	if (q->size == q->alloc) {
-		/* We filled all slots, increase by an alloc step */
-		size_t resize_to = q->size + SLOTS_PER_MALLOC;
-		/* If we fail, we do not want to lose the previous array of elements */
-		void **tmp;
-		if (!(tmp = realloc(q->e, resize_to * sizeof(*q->e))))
-			/* Failure, exit without changing the queue */
-			return -1;
-		/* Bookkeeping */
-		q->e = tmp;
-		q->alloc = resize_to;
-	}
+	/* Check if we have enough mem. slots, we filled all slots, double them */
+	if (q->size == q->alloc && resize(q, q->alloc << 1))
+		/* Failure, exit without changing the queue */
+		return -1;
 	/* Assume insertion at last index */
 	size_t i = q->size++;
+	if (q->size > q->peak)
+		q->peak = q->size;
 	size_t parent = PARENT(i);
 	/* heapify-up: propagate the new value upwards as long as it is smaller
 	 * than the parent of its insertion point, by swapping it with its parent
@@ -113,45 +147,188 @@ int minq_push(minqueue_t* q, void *v)
 	return 0;
 }
 
-/* Return smallest child available, or the root (0) if none */
-static inline size_t has_child(const minqueue_t *q, size_t i)
+/* Return smallest child available in the heap e[0..size), or the root (0)
+ * if none */
+static inline size_t has_child(void **e, size_t size, size_t i,
+		minq_key_cmp cmp)
 {
 	size_t left = LCHILD(i);
 	/* If we don't have child nodes, return the root of the tree */
-	if (left >= q->size)
+	if (left >= size)
 		return 0;
 	size_t right = left+1;
 	/* Check whether the right child is smaller than the left one */
-	if (right < q->size && q->cmp(q->e[left], q->e[right]))
+	if (right < size && cmp(e[left], e[right]))
 		/* right < left */
 		return right;
 	/* left < right */
 	return left;
 }
 
-void minq_pop(minqueue_t *q)
+/* heapify-down: Check that the node i is smaller than both of its
+ * child nodes, otherwise swap with the minimal child. */
+static void sift_down(void **e, size_t size, size_t current,
+		minq_key_cmp cmp)
 {
-	if (minq_empty(q)) return;
-	/* Swap root with last entry and
-	 * 'forget' about the last one, by decreasing the size*/
-	q->e[0] = q->e[--q->size];
-	/* We do not size down the alloc'd slots, the queue could grow again ... */
-	/* heapify-down: Check that the current node is smaller than both of its
-	 * child nodes, otherwise swap with the minimal child. */
-	size_t current = 0, min_child;
+	size_t min_child;
 	/* As long as current > min_child (if we have any) */
-	while ((min_child = has_child(q, current)) &&
-			q->cmp(q->e[current], q->e[min_child])) {
+	while ((min_child = has_child(e, size, current, cmp)) &&
+			cmp(e[current], e[min_child])) {
 		/* Swap the two elements */
 		void *tmp;
-		tmp = q->e[current];
-		q->e[current] = q->e[min_child];
-		q->e[min_child] = tmp;
+		tmp = e[current];
+		e[current] = e[min_child];
+		e[min_child] = tmp;
 		/* Check if we need to push the swapped value further down */
 		current = min_child;
 	}
 }
 
+/* Floyd's build-heap: restore the heap invariant on e[0..size) in O(size),
+ * by sifting down every node that has children, from the bottom up. */
+static void heapify(void **e, size_t size, minq_key_cmp cmp)
+{
+	if (size < 2) return;
+	size_t i = PARENT(size - 1) + 1;
+	while (i--)
+		sift_down(e, size, i, cmp);
+}
+
+/* Sort e[0..size) in increasing order, in-place */
+static void heap_sort(void **e, size_t size, minq_key_cmp cmp)
+{
+	size_t i, j;
+	void *tmp;
+	heapify(e, size, cmp);
+	/* Repeatedly move the minimum at the end of the shrinking heap, this
+	 * leaves the array sorted in decreasing order ... */
+	for (i = size; i > 1; --i) {
+		tmp = e[0];
+		e[0] = e[i - 1];
+		e[i - 1] = tmp;
+		sift_down(e, i - 1, 0, cmp);
+	}
+	/* ... which we then reverse */
+	for (i = 0, j = size; i + 1 < j; ++i) {
+		tmp = e[i];
+		e[i] = e[--j];
+		e[j] = tmp;
+	}
+}
+
+/* floor(log2(x)) + 1, i.e. the height of a heap holding x elements */
+static inline size_t heap_height(size_t x)
+{
+	size_t h = 0;
+	for (; x; x >>= 1)
+		++h;
+	return h;
+}
+
+/* Give back memory once the burst has been absorbed. A failure to shrink
+ * is harmless, we simply keep the larger array. */
+static inline void maybe_shrink(minqueue_t *q)
+{
+	if (q->size <= SHRINK_THRESHOLD(q->alloc) && q->alloc > q->min_alloc) {
+		size_t shrink_to = q->alloc >> 1;
+		resize(q, shrink_to < q->min_alloc ? q->min_alloc : shrink_to);
+	}
+}
+
+/* Remove the root of a non-empty queue, without resizing it */
+static inline void remove_root(minqueue_t *q)
+{
+	/* Swap root with last entry and
+	 * 'forget' about the last one, by decreasing the size*/
+	q->e[0] = q->e[--q->size];
+	sift_down(q->e, q->size, 0, q->cmp);
+}
+
+void minq_pop(minqueue_t *q)
+{
+	if (minq_empty(q)) return;
+	remove_root(q);
+	maybe_shrink(q);
+}
+
+int minq_push_bulk(minqueue_t *q, void **v, size_t n)
+{
+	size_t i;
+	if (!q || (n && !v)) return -1;
+	if (n > SIZE_MAX - q->size)
+		return -1;
+	/* Make room for all items at once, so that we cannot fail halfway */
+	if (q->size + n > q->alloc) {
+		size_t resize_to = q->alloc << 1;
+		if (resize_to < q->size + n)
+			resize_to = q->size + n;
+		if (resize(q, resize_to))
+			return -1;
+	}
+	if (n < q->size) {
+		/* Small batch: regular insertions are cheaper than a rebuild */
+		for (i = 0; i < n; ++i)
+			minq_push(q, v[i]);
+		return 0;
+	}
+	/* Large batch: append everything and rebuild the heap in O(size) */
+	memcpy(q->e + q->size, v, n * sizeof(*v));
+	q->size += n;
+	if (q->size > q->peak)
+		q->peak = q->size;
+	heapify(q->e, q->size, q->cmp);
+	return 0;
+}
+
+/* Move all items < key from the queue to out, in increasing order, provided
+ * that there are at most max of them, using a single pass on the array.
+ * @return: the number of items moved, or 0 if there were more than max
+ */
+static size_t extract_below(minqueue_t *q, const void *key,
+		void **out, size_t max)
+{
+	size_t i, count = 0, kept = 0;
+	/* Due to the heap invariant, all ancestors of an item < key are < key */
+	for (i = 0; i < q->size; ++i)
+		if (q->cmp(key, q->e[i]) && ++count > max)
+			return 0;
+	/* Partition the array between the extracted and the remaining items */
+	count = 0;
+	for (i = 0; i < q->size; ++i) {
+		if (q->cmp(key, q->e[i]))
+			out[count++] = q->e[i];
+		else
+			q->e[kept++] = q->e[i];
+	}
+	q->size = kept;
+	heapify(q->e, q->size, q->cmp);
+	heap_sort(out, count, q->cmp);
+	return count;
+}
+
+size_t minq_pop_until(minqueue_t *q, const void *key, void **out, size_t max)
+{
+	size_t n = 0, extracted;
+	int scanned = 0;
+	if (minq_empty(q) || !key || !out) return 0;
+	/* Popping k items costs O(k log(size)), past that budget a linear pass
+	 * over the whole array becomes cheaper */
+	size_t budget = q->size / heap_height(q->size);
+	while (n < max && !minq_empty(q) && q->cmp(key, *q->e)) {
+		if (n >= budget && !scanned) {
+			scanned = 1;
+			if ((extracted = extract_below(q, key, out + n, max - n))) {
+				n += extracted;
+				break;
+			}
+		}
+		out[n++] = *q->e;
+		remove_root(q);
+	}
+	maybe_shrink(q);
+	return n;
+}
+
 void* minq_peek(const minqueue_t *q)
 {
 	if (minq_empty(q)) return NULL;
@@ -168,3 +345,13 @@ size_t minq_size(const minqueue_t *q)
 {
 	return q ? q->size : 0;
 }
+
+size_t minq_capacity(const minqueue_t *q)
+{
+	return q ? q->alloc : 0;
+}
+
+size_t minq_peak(const minqueue_t *q)
+{
+	return q ? q->peak : 0;
+}
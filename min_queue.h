@@ -28,7 +28,8 @@ SOFTWARE.
 #include <stddef.h> /* size_t */
 
 /* Minimal priority queue,
- * provides O(log n) on push and pop, O(1) on peek
+ * provides O(log n) on push and pop, O(1) on peek,
+ * and batch variants for bursts of insertions or removals
  */
 
 typedef struct minqueue minqueue_t;
@@ -40,11 +41,18 @@ typedef int (*minq_key_cmp)(const void *a, const void *b);
 
 /* Create and initialize a new min-queue
  * @minq_key_cmp: The key compare function
+ * @capacity: How many slots to allocate upfront, 0 for the default.
+ *            The queue never shrinks below this capacity.
  * @return: NULL on error
  */
-minqueue_t *minq_new(minq_key_cmp);
+minqueue_t *minq_new(minq_key_cmp, size_t capacity);
 /* Destroy a min-queue instance */
 void minq_del(minqueue_t*);
+/* Ensure that the queue can hold at least n elements without reallocating,
+ * and never shrinks below that capacity afterwards.
+ * @return: non-zero value on error (queue is then untouched)
+ */
+int minq_reserve(minqueue_t*, size_t n);
 
 /* Insert a new element in the min-queue
  * @minqueue_t: The queue
@@ -52,8 +60,25 @@ void minq_del(minqueue_t*);
  * @return: non-zero value on error (queue is then untouched)
  */
 int minq_push(minqueue_t*, void *val);
+/* Insert n elements at once in the min-queue. Large batches are inserted
+ * by rebuilding the whole heap in O(size + n).
+ * @minqueue_t: The queue
+ * @v: the array of data to insert
+ * @n: the number of elements in v
+ * @return: non-zero value on error (queue is then untouched)
+ */
+int minq_push_bulk(minqueue_t*, void **v, size_t n);
 /* Remove the minimal element of the queue */
 void minq_pop(minqueue_t*);
+/* Remove all elements strictly smaller than key, in increasing order.
+ * Large bursts are extracted in a single pass over the queue.
+ * @minqueue_t: The queue
+ * @key: The threshold, compared with the minq_key_cmp of the queue
+ * @out: The array where to store the removed elements
+ * @max: The size of out, at most that many elements are removed
+ * @return: the number of elements stored in out
+ */
+size_t minq_pop_until(minqueue_t*, const void *key, void **out, size_t max);
 /* Get the minimal element of the queue */
 void* minq_peek(const minqueue_t*);
 /* Check whether the queue is empty or not
@@ -62,5 +87,9 @@ void* minq_peek(const minqueue_t*);
 int minq_empty(const minqueue_t*);
 /* How many items in the queue? */
 size_t minq_size(const minqueue_t*);
+/* How many items can the queue hold before having to grow? */
+size_t minq_capacity(const minqueue_t*);
+/* What is the largest number of items that were ever in the queue? */
+size_t minq_peak(const minqueue_t*);
 
 #endif
@@ -0,0 +1,339 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "pcap.h"
+
+#include <stdlib.h> /* malloc, free */
+#include <stdio.h> /* FILE, fopen, fread, fwrite */
+#include <string.h> /* memcpy */
+
+/* Magic numbers of the file header, for microsecond and nanosecond
+ * resolution timestamps */
+#define MAGIC_USEC 0xa1b2c3d4
+#define MAGIC_NSEC 0xa1b23c4d
+/* Size of the file and packet headers */
+#define FILE_HDR_LEN 24
+#define REC_HDR_LEN 16
+/* Largest snapshot length we accept */
+#define MAX_SNAPLEN 262144
+/* Size of the stdio buffer, large enough to make a syscall a rare event */
+#define IO_BUF_LEN (1 << 20)
+
+/* IP protocol number of UDP */
+#define IPPROTO_UDP_NUM 17
+/* Length of the fixed headers */
+#define IPV6_HDR_LEN 40
+#define UDP_HDR_LEN 8
+
+struct pcap_file {
+	FILE *f; /* The underlying file */
+	int swapped; /* Is the file in the opposite byte order? */
+	int nsec; /* Are the timestamps in ns instead of us? */
+	uint32_t linktype; /* Link type of the captured frames */
+	uint8_t *buf; /* Buffer receiving the packets read */
+	size_t buf_len; /* Size of buf */
+};
+
+static inline uint32_t swap32(uint32_t x)
+{
+	return (x >> 24) | ((x >> 8) & 0xff00) |
+		((x << 8) & 0xff0000) | (x << 24);
+}
+
+/* Decode a 32b integer stored in the file byte order */
+static inline uint32_t get32(const pcap_file_t *p, const uint8_t *b)
+{
+	uint32_t x;
+	memcpy(&x, b, sizeof(x));
+	return p->swapped ? swap32(x) : x;
+}
+
+/* Encode integers in the host byte order */
+static inline void put16(uint8_t *b, uint16_t x)
+{
+	memcpy(b, &x, sizeof(x));
+}
+
+static inline void put32(uint8_t *b, uint32_t x)
+{
+	memcpy(b, &x, sizeof(x));
+}
+
+/* Network byte order accessors */
+static inline uint16_t get16be(const uint8_t *b)
+{
+	return (uint16_t)(b[0] << 8 | b[1]);
+}
+
+static inline void put16be(uint8_t *b, uint16_t x)
+{
+	b[0] = x >> 8;
+	b[1] = x & 0xff;
+}
+
+static pcap_file_t *pcap_alloc(const char *path, const char *mode)
+{
+	pcap_file_t *p;
+	if (!(p = calloc(1, sizeof(*p))))
+		return NULL;
+	if (!(p->f = fopen(path, mode))) {
+		free(p);
+		return NULL;
+	}
+	/* Large buffers, as we process the whole file sequentially */
+	setvbuf(p->f, NULL, _IOFBF, IO_BUF_LEN);
+	return p;
+}
+
+pcap_file_t *pcap_open_read(const char *path)
+{
+	pcap_file_t *p;
+	uint8_t hdr[FILE_HDR_LEN];
+	uint32_t magic, snaplen;
+	if (!(p = pcap_alloc(path, "rb")))
+		return NULL;
+	if (fread(hdr, sizeof(hdr), 1, p->f) != 1)
+		goto fail;
+	memcpy(&magic, hdr, sizeof(magic));
+	if (magic == swap32(MAGIC_USEC) || magic == swap32(MAGIC_NSEC)) {
+		p->swapped = 1;
+		magic = swap32(magic);
+	}
+	if (magic != MAGIC_USEC && magic != MAGIC_NSEC)
+		goto fail;
+	p->nsec = magic == MAGIC_NSEC;
+	snaplen = get32(p, hdr + 16);
+	/* The top bits of the link type can carry the FCS length */
+	p->linktype = get32(p, hdr + 20) & 0x0fffffff;
+	p->buf_len = snaplen && snaplen < MAX_SNAPLEN ? snaplen : MAX_SNAPLEN;
+	if (!(p->buf = malloc(p->buf_len)))
+		goto fail;
+	return p;
+
+fail:
+	pcap_close(p);
+	return NULL;
+}
+
+pcap_file_t *pcap_open_write(const char *path, uint32_t linktype)
+{
+	pcap_file_t *p;
+	uint8_t hdr[FILE_HDR_LEN];
+	if (!(p = pcap_alloc(path, "wb")))
+		return NULL;
+	p->linktype = linktype;
+	memset(hdr, 0, sizeof(hdr));
+	put32(hdr, MAGIC_USEC);
+	/* Version 2.4 */
+	put16(hdr + 4, 2);
+	put16(hdr + 6, 4);
+	put32(hdr + 16, MAX_SNAPLEN);
+	put32(hdr + 20, linktype);
+	if (fwrite(hdr, sizeof(hdr), 1, p->f) != 1) {
+		pcap_close(p);
+		return NULL;
+	}
+	return p;
+}
+
+int pcap_close(pcap_file_t *p)
+{
+	int err;
+	if (!p) return 0;
+	err = fclose(p->f);
+	free(p->buf);
+	free(p);
+	return err;
+}
+
+uint32_t pcap_linktype(const pcap_file_t *p)
+{
+	return p->linktype;
+}
+
+int pcap_next(pcap_file_t *p, struct pcap_rec *rec, uint8_t **data)
+{
+	uint8_t hdr[REC_HDR_LEN];
+	size_t caplen;
+	if (fread(hdr, sizeof(hdr), 1, p->f) != 1)
+		return feof(p->f) ? 0 : -1;
+	rec->ts.tv_sec = get32(p, hdr);
+	rec->ts.tv_usec = get32(p, hdr + 4);
+	if (p->nsec)
+		rec->ts.tv_usec /= 1000;
+	caplen = get32(p, hdr + 8);
+	rec->len = get32(p, hdr + 12);
+	/* Keep what fits in our buffer and skip the rest */
+	rec->caplen = caplen < p->buf_len ? caplen : p->buf_len;
+	if (fread(p->buf, 1, rec->caplen, p->f) != rec->caplen ||
+		(caplen > rec->caplen &&
+		 fseek(p->f, caplen - rec->caplen, SEEK_CUR)))
+		return -1;
+	*data = p->buf;
+	return 1;
+}
+
+int pcap_write(pcap_file_t *p, const struct timeval *ts,
+		const uint8_t *data, size_t len)
+{
+	uint8_t hdr[REC_HDR_LEN];
+	put32(hdr, ts->tv_sec);
+	put32(hdr + 4, ts->tv_usec);
+	put32(hdr + 8, len);
+	put32(hdr + 12, len);
+	return fwrite(hdr, sizeof(hdr), 1, p->f) != 1 ||
+		fwrite(data, 1, len, p->f) != len;
+}
+
+/* Find the offset of the IP header in a frame
+ * @return: non-zero value if the frame does not carry IP
+ */
+static int ip_offset(uint32_t linktype, const uint8_t *frame, size_t len,
+		size_t *offset)
+{
+	uint16_t ethertype;
+	size_t off;
+	switch (linktype) {
+		case LINKTYPE_NULL: off = 4;
+							break;
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6: off = 0;
+							break;
+		case LINKTYPE_ETHERNET:
+			if (len < 14) return -1;
+			off = 14;
+			ethertype = get16be(frame + 12);
+			/* Skip one 802.1Q tag */
+			if (ethertype == 0x8100) {
+				if (len < 18) return -1;
+				off = 18;
+				ethertype = get16be(frame + 16);
+			}
+			if (ethertype != 0x0800 && ethertype != 0x86DD) return -1;
+			break;
+		case LINKTYPE_LINUX_SLL:
+			if (len < 16) return -1;
+			off = 16;
+			ethertype = get16be(frame + 14);
+			if (ethertype != 0x0800 && ethertype != 0x86DD) return -1;
+			break;
+		case LINKTYPE_LINUX_SLL2:
+			if (len < 20) return -1;
+			off = 20;
+			ethertype = get16be(frame);
+			if (ethertype != 0x0800 && ethertype != 0x86DD) return -1;
+			break;
+		default: return -1;
+	}
+	*offset = off;
+	return 0;
+}
+
+int pcap_udp_parse(uint32_t linktype, const uint8_t *frame, size_t caplen,
+		struct pcap_udp *u)
+{
+	const uint8_t *ip, *udp;
+	size_t ip_hdr_len, udp_len;
+	if (ip_offset(linktype, frame, caplen, &u->ip_off) ||
+		caplen <= u->ip_off)
+		return -1;
+	ip = frame + u->ip_off;
+	/* The IP version is found in the first nibble */
+	switch (ip[0] >> 4) {
+		case 4:
+			ip_hdr_len = (ip[0] & 0x0f) * 4;
+			if (caplen < u->ip_off + 20 || ip_hdr_len < 20 ||
+				/* Not UDP, or a fragment (MF or fragment offset set) */
+				ip[9] != IPPROTO_UDP_NUM || (get16be(ip + 6) & 0x3fff))
+				return -1;
+			u->ipv6 = 0;
+			break;
+		case 6:
+			ip_hdr_len = IPV6_HDR_LEN;
+			/* We do not parse extension headers */
+			if (caplen < u->ip_off + IPV6_HDR_LEN || ip[6] != IPPROTO_UDP_NUM)
+				return -1;
+			u->ipv6 = 1;
+			break;
+		default: return -1;
+	}
+	u->hdr_len = u->ip_off + ip_hdr_len + UDP_HDR_LEN;
+	if (u->hdr_len > PCAP_MAX_HDR_LEN || caplen < u->hdr_len)
+		return -1;
+	udp = ip + ip_hdr_len;
+	udp_len = get16be(udp + 4);
+	/* The whole payload must have been captured */
+	if (udp_len < UDP_HDR_LEN || caplen < u->hdr_len - UDP_HDR_LEN + udp_len)
+		return -1;
+	u->sport = get16be(udp);
+	u->dport = get16be(udp + 2);
+	u->len = udp_len - UDP_HDR_LEN;
+	return 0;
+}
+
+/* Sum 16b words in network byte order, in a 32b accumulator */
+static uint32_t csum_add(uint32_t sum, const uint8_t *b, size_t len)
+{
+	for (; len > 1; len -= 2, b += 2)
+		sum += get16be(b);
+	if (len)
+		sum += b[0] << 8;
+	return sum;
+}
+
+/* Fold a 32b accumulator into the one's complement checksum */
+static uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+void pcap_udp_fixup(uint8_t *frame, const struct pcap_udp *u, size_t len)
+{
+	uint8_t *ip = frame + u->ip_off;
+	uint8_t *udp = frame + u->hdr_len - UDP_HDR_LEN;
+	size_t udp_len = len + UDP_HDR_LEN;
+	uint32_t sum;
+	uint16_t csum;
+	if (u->ipv6) {
+		put16be(ip + 4, udp_len);
+		/* Pseudo-header: addresses, length and next header */
+		sum = csum_add(0, ip + 8, 32);
+	} else {
+		size_t ip_hdr_len = (ip[0] & 0x0f) * 4;
+		put16be(ip + 2, ip_hdr_len + udp_len);
+		put16be(ip + 10, 0);
+		put16be(ip + 10, csum_fold(csum_add(0, ip, ip_hdr_len)));
+		/* Pseudo-header: addresses, protocol and length */
+		sum = csum_add(0, ip + 12, 8);
+	}
+	sum += IPPROTO_UDP_NUM + udp_len;
+	put16be(udp + 4, udp_len);
+	put16be(udp + 6, 0);
+	csum = csum_fold(csum_add(sum, udp, udp_len));
+	/* A null checksum is transmitted as all ones */
+	put16be(udp + 6, csum ? csum : 0xffff);
+}
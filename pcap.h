@@ -0,0 +1,107 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef __PCAP_H_
+#define __PCAP_H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint8_t, ... */
+#include <sys/time.h> /* timeval */
+
+/* Minimal reader/writer for the classic libpcap file format,
+ * along with helpers to locate and rewrite the UDP payload of a captured
+ * frame. This avoids a dependency on libpcap for the offline mode.
+ */
+
+/* Supported link types */
+#define LINKTYPE_NULL 0 /* BSD loopback */
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101 /* Raw IPv4/IPv6 */
+#define LINKTYPE_LINUX_SLL 113 /* Linux 'any' interface */
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+/* Max length of the headers preceding a UDP payload that we support
+ * (link-layer + IPv4 with options + UDP) */
+#define PCAP_MAX_HDR_LEN 128
+
+typedef struct pcap_file pcap_file_t;
+
+/* The header of one captured packet */
+struct pcap_rec {
+	struct timeval ts; /* Capture date */
+	size_t caplen; /* How many bytes of the packet have been captured */
+	size_t len; /* How many bytes were on the wire */
+};
+
+/* Open a capture file for reading
+ * @return: NULL on error
+ */
+pcap_file_t *pcap_open_read(const char *path);
+/* Create a capture file
+ * @linktype: The link type of the frames that will be written
+ * @return: NULL on error
+ */
+pcap_file_t *pcap_open_write(const char *path, uint32_t linktype);
+/* Flush and close a capture file
+ * @return: non-zero value if some data could not be written
+ */
+int pcap_close(pcap_file_t*);
+/* The link type of the frames in the capture file */
+uint32_t pcap_linktype(const pcap_file_t*);
+
+/* Read the next packet of a capture file
+ * @rec: Where to store the packet header
+ * @data: Set to the packet content, valid until the next call
+ * @return: 1 if a packet was read, 0 at the end of the file, -1 on error
+ */
+int pcap_next(pcap_file_t*, struct pcap_rec *rec, uint8_t **data);
+/* Append a packet to a capture file
+ * @return: non-zero value on error
+ */
+int pcap_write(pcap_file_t*, const struct timeval *ts,
+		const uint8_t *data, size_t len);
+
+/* Location of a UDP datagram within a captured frame */
+struct pcap_udp {
+	size_t ip_off; /* Offset of the IP header */
+	size_t hdr_len; /* Offset of the UDP payload */
+	size_t len; /* Length of the UDP payload */
+	int ipv6; /* Is this IPv6 or IPv4? */
+	uint16_t sport; /* UDP source port, in host order */
+	uint16_t dport; /* UDP destination port, in host order */
+};
+
+/* Locate the UDP payload of a captured frame
+ * @return: non-zero value if this is not a complete, unfragmented UDP
+ *          datagram whose headers fit in PCAP_MAX_HDR_LEN bytes
+ */
+int pcap_udp_parse(uint32_t linktype, const uint8_t *frame, size_t caplen,
+		struct pcap_udp *u);
+/* Update the IP and UDP lengths and checksums of a frame parsed by
+ * pcap_udp_parse, whose payload is now len bytes long. */
+void pcap_udp_fixup(uint8_t *frame, const struct pcap_udp *u, size_t len);
+
+#endif
@@ -0,0 +1,170 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "linksim.h"
+
+#include <string.h> /* strcmp */
+
+/* The protocol of the LINGI1341 project: the type of the packet is in the
+ * 2 top bits of its first byte, followed by the truncation bit. Data packets
+ * can be cut after their 12 bytes of header. */
+
+/* Min packet length of a data packet in the protocol */
+#define TRTP_PDATA_HDR_LEN 12
+#define TRTP_TYPE(buf) (((uint8_t)(buf)[0]) >> 6)
+#define TRTP_TYPE_DATA 1
+#define TRTP_TRUNCATED 0x20
+
+static void trtp_parse(const char *buf, size_t len, struct linksim_hdr *hdr)
+{
+	hdr->type = TRTP_TYPE(buf) == 0 ? "FEC" : "SEQ";
+	hdr->has_seq = len >= 4;
+	hdr->seq = len < 4 ? 0 :
+		(uint8_t)(TRTP_TYPE(buf) <= TRTP_TYPE_DATA ? buf[3] : buf[1]);
+	hdr->hdr_len = TRTP_TYPE(buf) == TRTP_TYPE_DATA &&
+		len > TRTP_PDATA_HDR_LEN ? TRTP_PDATA_HDR_LEN : 0;
+}
+
+static void trtp_truncate(char *buf, size_t len)
+{
+	(void)len;
+	buf[0] |= TRTP_TRUNCATED;
+}
+
+const struct linksim_proto linksim_proto_trtp = {
+	.name = "trtp",
+	.min_len = 10,
+	.parse = trtp_parse,
+	.truncate = trtp_truncate,
+};
+
+/* Opaque UDP payloads: nothing is known about them, they cannot be cut */
+static void raw_parse(const char *buf, size_t len, struct linksim_hdr *hdr)
+{
+	(void)buf;
+	(void)len;
+	hdr->type = "UDP";
+	hdr->has_seq = 0;
+	hdr->hdr_len = 0;
+}
+
+const struct linksim_proto linksim_proto_raw = {
+	.name = "raw",
+	.min_len = 1,
+	.parse = raw_parse,
+	.truncate = NULL,
+};
+
+/* QUIC (RFC 9000). The packet numbers are protected, thus are not logged.
+ * The header of a short header (1-RTT) packet does not tell the length of
+ * the connection ID, hence only the long header packets can be cut: right
+ * before their packet number, which looks to the receiver like a packet
+ * damaged in transit. */
+#define QUIC_LONG_HEADER 0x80
+#define QUIC_SPIN_BIT 0x20
+
+/* Read a variable-length integer
+ * @return: its length, 0 if it does not fit in the len bytes of buf */
+static size_t quic_varint(const uint8_t *buf, size_t len, uint64_t *v)
+{
+	size_t n, i;
+	if (!len)
+		return 0;
+	n = (size_t)1 << (buf[0] >> 6);
+	if (n > len)
+		return 0;
+	*v = buf[0] & 0x3f;
+	for (i = 1; i < n; ++i)
+		*v = (*v << 8) | buf[i];
+	return n;
+}
+
+/* @return: the length of a long header, up to the packet number, 0 if the
+ *          packet is too short or has no packet number */
+static size_t quic_long_hdr_len(const uint8_t *buf, size_t len)
+{
+	size_t off = 5, n; /* First byte and version */
+	uint64_t v;
+	/* Version negotiation and retry packets have no packet number */
+	if (len < 7 || !(buf[1] | buf[2] | buf[3] | buf[4]) ||
+			((buf[0] >> 4) & 3) == 3)
+		return 0;
+	/* Destination then source connection IDs */
+	off += 1 + buf[off];
+	if (off >= len)
+		return 0;
+	off += 1 + buf[off];
+	/* Initial packets carry a token */
+	if (((buf[0] >> 4) & 3) == 0) {
+		if (off >= len || !(n = quic_varint(buf + off, len - off, &v)))
+			return 0;
+		off += n + v;
+	}
+	/* Then the length of the rest of the packet */
+	if (off >= len || !(n = quic_varint(buf + off, len - off, &v)))
+		return 0;
+	off += n;
+	return off < len ? off : 0;
+}
+
+static void quic_parse(const char *buf, size_t len, struct linksim_hdr *hdr)
+{
+	static const char *long_types[] = {
+		"Initial", "0-RTT", "Handshake", "Retry"
+	};
+	const uint8_t *b = (const uint8_t*)buf;
+	hdr->has_seq = 0;
+	hdr->hdr_len = 0;
+	if (!len) {
+		hdr->type = "QUIC";
+		return;
+	}
+	if (!(b[0] & QUIC_LONG_HEADER)) {
+		hdr->type = b[0] & QUIC_SPIN_BIT ? "1-RTT s1" : "1-RTT s0";
+		return;
+	}
+	hdr->hdr_len = quic_long_hdr_len(b, len);
+	hdr->type = len >= 5 && !(b[1] | b[2] | b[3] | b[4]) ?
+		"VerNeg" : long_types[(b[0] >> 4) & 3];
+}
+
+const struct linksim_proto linksim_proto_quic = {
+	.name = "quic",
+	.min_len = 1,
+	.parse = quic_parse,
+	.truncate = NULL,
+};
+
+const struct linksim_proto *linksim_proto_find(const char *name)
+{
+	static const struct linksim_proto *protos[] = {
+		&linksim_proto_trtp, &linksim_proto_raw, &linksim_proto_quic,
+	};
+	size_t i;
+	for (i = 0; i < sizeof(protos) / sizeof(*protos); ++i)
+		if (!strcmp(protos[i]->name, name))
+			return protos[i];
+	return NULL;
+}
@@ -0,0 +1,156 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifdef __linux__
+/* sched_setaffinity() and the CPU_X macros */
+#define _GNU_SOURCE
+#endif
+
+#include "realtime.h"
+
+#include <stdio.h> /* fprintf, perror, sscanf */
+#include <stdlib.h> /* strtol */
+#include <string.h> /* strncmp */
+#include <errno.h> /* errno */
+#include <sched.h> /* sched_x */
+#include <sys/mman.h> /* mlockall */
+
+#ifdef __linux__
+/* Parse a list of CPUs
+ * @return: non-zero value if it is invalid */
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+	const char *c = list;
+	char *end;
+	long first, last;
+	CPU_ZERO(set);
+	do {
+		errno = 0;
+		first = last = strtol(c, &end, 10);
+		if (errno || end == c || first < 0)
+			return -1;
+		if (*end == '-') {
+			c = end + 1;
+			last = strtol(c, &end, 10);
+			if (errno || end == c || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+		c = end + 1;
+	} while (*end == ',');
+	return *end != '\0';
+}
+
+/* Print a set of CPUs as a list of ranges */
+static void print_cpus(FILE *f, const cpu_set_t *set)
+{
+	int cpu, last, sep = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+		for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set);
+				++last);
+		fprintf(f, sep ? ",%d" : "%d", cpu);
+		if (last > cpu)
+			fprintf(f, "-%d", last);
+		sep = 1;
+		cpu = last;
+	}
+}
+#endif
+
+int rt_pin_cpus(const char *cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	if (parse_cpus(cpus, &set)) {
+		fprintf(stderr, "!! Invalid list of CPUs %s\n", cpus);
+		return -1;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		perror("Cannot pin the process");
+		return -1;
+	}
+	if (!sched_getaffinity(0, sizeof(set), &set)) {
+		fprintf(stderr, "@@ Pinned to CPU(s) ");
+		print_cpus(stderr, &set);
+		fprintf(stderr, "\n");
+	}
+	return 0;
+#else
+	fprintf(stderr, "!! Cannot pin the process to CPU(s) %s: not supported "
+			"on this system\n", cpus);
+	return -1;
+#endif
+}
+
+int rt_set_fifo(int priority)
+{
+	struct sched_param param;
+	int min = sched_get_priority_min(SCHED_FIFO),
+		max = sched_get_priority_max(SCHED_FIFO);
+	if (priority < min || priority > max) {
+		fprintf(stderr, "!! The SCHED_FIFO priority must be between %d and "
+				"%d\n", min, max);
+		return -1;
+	}
+	param.sched_priority = priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+		perror("Cannot use SCHED_FIFO");
+		return -1;
+	}
+	if (sched_getscheduler(0) == SCHED_FIFO && !sched_getparam(0, &param))
+		fprintf(stderr, "@@ Running with SCHED_FIFO, priority %d\n",
+				param.sched_priority);
+	return 0;
+}
+
+int rt_lock_memory()
+{
+	char line[128];
+	unsigned long kb;
+	FILE *f;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("Cannot lock the memory");
+		return -1;
+	}
+	/* Tell how much was locked where the system reports it */
+	if ((f = fopen("/proc/self/status", "r"))) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!strncmp(line, "VmLck:", 6) &&
+					sscanf(line + 6, "%lu", &kb) == 1) {
+				fprintf(stderr, "@@ Locked %lu kB of memory\n", kb);
+				fclose(f);
+				return 0;
+			}
+		}
+		fclose(f);
+	}
+	fprintf(stderr, "@@ Locked the memory\n");
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*  vi:ts=4:sw=4:noet
+The MIT License (MIT)
+
+Copyright (c) 2015-2016 Olivier Tilmans, olivier.tilmans@uclouvain.be
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __REALTIME_H_
+#define __REALTIME_H_
+
+/* Settings reducing the latency noise of the process, for measurements.
+ * Each of them reports on stderr what the system granted, and failing to
+ * obtain one is not fatal. */
+
+/* Pin the process to a set of CPUs
+ * @cpus: A list of CPUs and ranges, e.g. "2" or "0-3,6"
+ * @return: non-zero value if the list is invalid, or pinning failed
+ */
+int rt_pin_cpus(const char *cpus);
+/* Run the process with the SCHED_FIFO real-time policy
+ * @return: non-zero value on error
+ */
+int rt_set_fifo(int priority);
+/* Lock the current and future pages of the process in memory, faulting in
+ * all those that are already mapped
+ * @return: non-zero value on error
+ */
+int rt_lock_memory();
+
+#endif